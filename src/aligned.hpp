@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <new>
+
+namespace tinycthyb {
+
+// Storage for the hot loops over operator times and the inverse matrix: every
+// buffer starts on a cache line and every matrix row is padded to a whole
+// number of cache lines, so the loops over a row run at unit stride from an
+// aligned address, with no peeled iterations.
+constexpr std::size_t cache_line = 64;
+
+namespace detail {
+
+struct AlignedFree {
+  void operator()(void *p) const { std::free(p); }
+};
+
+template <typename T>
+std::unique_ptr<T[], AlignedFree> aligned_zeros(std::size_t n) {
+  std::size_t bytes = std::max<std::size_t>(n * sizeof(T), cache_line);
+  bytes = (bytes + cache_line - 1) / cache_line * cache_line;
+  T *p = static_cast<T *>(std::aligned_alloc(cache_line, bytes));
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  std::fill(p, p + bytes / sizeof(T), T{});
+  return std::unique_ptr<T[], AlignedFree>(p);
+}
+
+} // namespace detail
+
+template <typename T> class AlignedVector {
+public:
+  AlignedVector(long n = 0) : n(n), buf(detail::aligned_zeros<T>(n)) {}
+
+  AlignedVector(const AlignedVector &other) : AlignedVector(other.n) {
+    std::copy(other.begin(), other.end(), begin());
+  }
+
+  AlignedVector &operator=(const AlignedVector &other) {
+    if (this != &other) {
+      AlignedVector copy(other);
+      std::swap(*this, copy);
+    }
+    return *this;
+  }
+
+  AlignedVector(AlignedVector &&) = default;
+  AlignedVector &operator=(AlignedVector &&) = default;
+
+  T &operator()(long i) { return buf[i]; }
+  const T &operator()(long i) const { return buf[i]; }
+  T *data() { return buf.get(); }
+  const T *data() const { return buf.get(); }
+  T *begin() { return buf.get(); }
+  T *end() { return buf.get() + n; }
+  const T *begin() const { return buf.get(); }
+  const T *end() const { return buf.get() + n; }
+  long size() const { return n; }
+
+private:
+  long n;
+  std::unique_ptr<T[], detail::AlignedFree> buf;
+};
+
+// Row-major, with the rows stride() elements apart.
+template <typename T> class AlignedMatrix {
+public:
+  AlignedMatrix(long rows = 0, long cols = 0)
+      : n_rows(rows), n_cols(cols), ld(padded(cols)),
+        buf(detail::aligned_zeros<T>(rows * padded(cols))) {}
+
+  AlignedMatrix(const AlignedMatrix &other)
+      : AlignedMatrix(other.n_rows, other.n_cols) {
+    std::copy(other.data(), other.data() + n_rows * ld, data());
+  }
+
+  AlignedMatrix &operator=(const AlignedMatrix &other) {
+    if (this != &other) {
+      AlignedMatrix copy(other);
+      std::swap(*this, copy);
+    }
+    return *this;
+  }
+
+  AlignedMatrix(AlignedMatrix &&) = default;
+  AlignedMatrix &operator=(AlignedMatrix &&) = default;
+
+  T &operator()(long i, long j) { return buf[i * ld + j]; }
+  const T &operator()(long i, long j) const { return buf[i * ld + j]; }
+  T *data() { return buf.get(); }
+  const T *data() const { return buf.get(); }
+  long rows() const { return n_rows; }
+  long cols() const { return n_cols; }
+  long stride() const { return ld; }
+
+  // Columns rounded up to whole cache lines.
+  static long padded(long cols) {
+    long per_line = cache_line / sizeof(T);
+    return (cols + per_line - 1) / per_line * per_line;
+  }
+
+private:
+  long n_rows;
+  long n_cols;
+  long ld;
+  std::unique_ptr<T[], detail::AlignedFree> buf;
+};
+
+} // namespace tinycthyb
@@ -0,0 +1,134 @@
+// Interposes the C allocation functions for the whole program and counts them
+// per thread for allocation_count(). Linked only when the COUNT_ALLOCATIONS
+// option is on; the functions it forwards to are looked up with dlsym.
+#include <cstddef>
+#include <cstring>
+#include <dlfcn.h>
+
+#include "allocations.hpp"
+
+namespace tinycthyb::detail {
+thread_local long allocations = 0;
+} // namespace tinycthyb::detail
+
+namespace {
+
+using Malloc = void *(*)(std::size_t);
+using Calloc = void *(*)(std::size_t, std::size_t);
+using Realloc = void *(*)(void *, std::size_t);
+using AlignedAlloc = void *(*)(std::size_t, std::size_t);
+using PosixMemalign = int (*)(void **, std::size_t, std::size_t);
+using Free = void (*)(void *);
+
+Malloc next_malloc = nullptr;
+Calloc next_calloc = nullptr;
+Realloc next_realloc = nullptr;
+AlignedAlloc next_aligned_alloc = nullptr;
+PosixMemalign next_posix_memalign = nullptr;
+Free next_free = nullptr;
+
+// dlsym may itself allocate while the functions are being looked up; those
+// few requests are served from this zeroed buffer and never freed.
+constexpr std::size_t bootstrap_size = 16384;
+alignas(64) char bootstrap[bootstrap_size];
+std::size_t bootstrap_used = 0;
+bool resolving = false;
+
+void *bootstrap_alloc(std::size_t n) {
+  n = (n + 63) / 64 * 64;
+  if (bootstrap_used + n > bootstrap_size) {
+    return nullptr;
+  }
+  void *p = bootstrap + bootstrap_used;
+  bootstrap_used += n;
+  return p;
+}
+
+bool from_bootstrap(void *p) {
+  return p >= static_cast<void *>(bootstrap) &&
+         p < static_cast<void *>(bootstrap + bootstrap_size);
+}
+
+// The first allocation happens before main, on one thread.
+bool resolve() {
+  if (next_malloc != nullptr) {
+    return true;
+  }
+  if (resolving) {
+    return false;
+  }
+  resolving = true;
+  next_malloc = reinterpret_cast<Malloc>(dlsym(RTLD_NEXT, "malloc"));
+  next_calloc = reinterpret_cast<Calloc>(dlsym(RTLD_NEXT, "calloc"));
+  next_realloc = reinterpret_cast<Realloc>(dlsym(RTLD_NEXT, "realloc"));
+  next_aligned_alloc =
+      reinterpret_cast<AlignedAlloc>(dlsym(RTLD_NEXT, "aligned_alloc"));
+  next_posix_memalign =
+      reinterpret_cast<PosixMemalign>(dlsym(RTLD_NEXT, "posix_memalign"));
+  next_free = reinterpret_cast<Free>(dlsym(RTLD_NEXT, "free"));
+  resolving = false;
+  return next_malloc != nullptr;
+}
+
+} // namespace
+
+extern "C" {
+
+void *malloc(std::size_t n) noexcept {
+  if (!resolve()) {
+    return bootstrap_alloc(n);
+  }
+  tinycthyb::detail::allocations++;
+  return next_malloc(n);
+}
+
+void *calloc(std::size_t n, std::size_t size) noexcept {
+  if (!resolve()) {
+    return bootstrap_alloc(n * size);
+  }
+  tinycthyb::detail::allocations++;
+  return next_calloc(n, size);
+}
+
+void *realloc(void *p, std::size_t n) noexcept {
+  if (from_bootstrap(p)) {
+    void *q = malloc(n);
+    if (q != nullptr) {
+      std::size_t left = bootstrap + bootstrap_size - static_cast<char *>(p);
+      std::memcpy(q, p, n < left ? n : left);
+    }
+    return q;
+  }
+  if (!resolve()) {
+    return bootstrap_alloc(n);
+  }
+  tinycthyb::detail::allocations++;
+  return next_realloc(p, n);
+}
+
+void *aligned_alloc(std::size_t align, std::size_t n) noexcept {
+  if (!resolve()) {
+    return bootstrap_alloc(n);
+  }
+  tinycthyb::detail::allocations++;
+  return next_aligned_alloc(align, n);
+}
+
+int posix_memalign(void **p, std::size_t align, std::size_t n) noexcept {
+  if (!resolve()) {
+    *p = bootstrap_alloc(n);
+    return *p == nullptr ? 12 : 0; // ENOMEM
+  }
+  tinycthyb::detail::allocations++;
+  return next_posix_memalign(p, align, n);
+}
+
+void free(void *p) noexcept {
+  if (p == nullptr || from_bootstrap(p)) {
+    return;
+  }
+  if (resolve()) {
+    next_free(p);
+  }
+}
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+namespace tinycthyb {
+
+#ifdef TINYCTHYB_COUNT_ALLOCATIONS
+
+namespace detail {
+// Defined in allocations.cpp, which counts at the level of malloc and is
+// linked into every executable when TINYCTHYB_COUNT_ALLOCATIONS is set.
+extern thread_local long allocations;
+} // namespace detail
+
+// Heap allocations made by the calling thread, so that operator new, the
+// aligned buffers and the nda arrays are all seen.
+inline long allocation_count() { return detail::allocations; }
+
+#else
+
+inline long allocation_count() { return 0; }
+
+#endif
+
+} // namespace tinycthyb
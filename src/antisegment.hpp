@@ -78,17 +78,22 @@ AntiSegmentIterator antisegments(Configuration &c) {
 }
 
 std::optional<AntiSegment> onantisegment(double t, Configuration &c) {
-  for (auto s : antisegments(c)) {
-    if (s.onantisegment(t)) {
-      return s;
-    }
+  if (c.length() == 0 || c.occupied(t)) {
+    return std::nullopt;
+  }
+  auto [i_idx, f_idx] = c.preceding(t);
+  if (c.t_i((i_idx + 1) % c.length()) == t ||
+      c.t_f((f_idx + 1) % c.length()) == t) {
+    return std::nullopt;
   }
-  return std::nullopt;
+  f_idx = f_idx < 0 ? c.length() - 1 : f_idx;
+  return AntiSegment(c.t_f(f_idx), c.t_i((i_idx + 1) % c.length()));
 }
 
 void remove_antisegment(Configuration &c, int segment_idx) {
   auto [f_idx, i_idx] = antisegments(c).indices(segment_idx);
-  c.t_i = deleteat(c.t_i, i_idx);
-  c.t_f = deleteat(c.t_f, f_idx);
+  auto move = RemovalMove(i_idx, f_idx, 0.0);
+  c.remove(move);
+  c.commit();
 }
 } // namespace tinycthyb
@@ -0,0 +1,220 @@
+#include "fixtures.hpp"
+#include "green.hpp"
+#include "solver.hpp"
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace tinycthyb;
+
+struct Result {
+  std::string name;
+  double beta;
+  int order;
+  double ns_per_op;
+};
+
+template <typename Times> int index_of(const Times &t, int n, double value) {
+  return std::distance(t.begin(),
+                       std::lower_bound(t.begin(), t.begin() + n, value));
+}
+
+// Calls f(0), f(1), ... in growing batches until at least min_seconds have
+// passed and returns the average time per call.
+template <typename F> double time_ns(F &&f, double min_seconds = 0.2) {
+  long n = 0;
+  long batch = 1;
+  double elapsed = 0.0;
+  auto start = std::chrono::steady_clock::now();
+  while (elapsed < min_seconds) {
+    for (long i = 0; i < batch; i++, n++) {
+      f(n);
+    }
+    auto stop = std::chrono::steady_clock::now();
+    elapsed = std::chrono::duration<double>(stop - start).count();
+    batch *= 2;
+  }
+  return 1e9 * elapsed / n;
+}
+
+// Time per statistically independent G(tau) measurement, i.e. per
+// 2 tau_int sampling epochs, of a 2 s adaptive run with the given moves.
+template <typename Moves>
+double effective_sample_ns(Expansion &e, Configurations c, Moves moves) {
+  auto S = Solver(e, moves, 200, 0, 0, 4321);
+  S.verbose = false;
+  Convergence conv;
+  conv.max_sampling_epochs = std::numeric_limits<long>::max();
+  conv.max_seconds = 2.0;
+  auto start = std::chrono::steady_clock::now();
+  S.solve(c, conv);
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  auto tau = S.g_binning[0].autocorrelation_time();
+  double tau_max = std::max(0.5, *std::max_element(tau.begin(), tau.end()));
+  return 1e9 * seconds * 2.0 * tau_max / S.sampled_epochs;
+}
+
+// Keeps results alive so that the timed calls are not optimized away.
+volatile double sink = 0.0;
+
+int main(int argc, char *argv[]) {
+  std::string filename = argc > 1 ? argv[1] : "benchmark.json";
+  std::vector<double> betas = {10.0, 20.0, 50.0, 100.0};
+  std::vector<int> orders = {4, 8, 16, 32, 64, 128};
+  int nt = 1000;
+  int n_moves = 256;
+  std::vector<Result> results;
+
+  auto moves = MoveSet<NewSegmentInsertionMove, NewAntiSegmentInsertionMove,
+                       NewSegmentRemoveMove, NewAntiSegmentRemoveMove>();
+
+  for (auto beta : betas) {
+    auto Delta = semi_circular_hybridization(beta, nt);
+    auto e = Expansion(beta, 0.0, Delta);
+    Rng rng(1234);
+
+    double ns = time_ns([&](long) {
+      sink = sink + Delta(beta * (2.0 * rng.uniform() - 1.0));
+    });
+    results.push_back({"Hybridization::operator()", beta, 0, ns});
+
+    for (auto order : orders) {
+      auto cs = Configurations{random_configuration(order, beta, rng)};
+      auto &c = cs[0];
+      auto S = Solver(e, moves, 200, 30, 100, 4321);
+      S.d[0].rebuild(c);
+
+      ns = time_ns([&](long) {
+        auto move = NewSegmentInsertionMove(cs, e, S.rng);
+        sink = sink + move.l;
+      });
+      results.push_back({"NewSegmentInsertionMove", beta, order, ns});
+
+      std::vector<InsertMove> inserts;
+      while (static_cast<int>(inserts.size()) < n_moves) {
+        auto move = NewSegmentInsertionMove(cs, e, S.rng);
+        if (move.l > 0.0) {
+          inserts.push_back(move);
+        }
+      }
+
+      ns = time_ns([&](long i) {
+        auto &move = inserts[i % n_moves];
+        sink = sink + S.propose(cs, move);
+        c.rollback();
+      });
+      results.push_back({"Solver::propose(InsertMove)", beta, order, ns});
+
+      // Insert a segment and remove it again, so the order stays fixed.
+      ns = time_ns([&](long i) {
+        auto &move = inserts[i % n_moves];
+        S.propose(cs, move);
+        S.finalize(cs, move);
+        auto removal = RemovalMove(index_of(c.t_i, c.length(), move.t_i),
+                                   index_of(c.t_f, c.length(), move.t_f), 1.0);
+        sink = sink + S.propose(cs, removal);
+        S.finalize(cs, removal);
+      }) / 2.0;
+      results.push_back({"Solver::propose+finalize", beta, order, ns});
+
+      // Bursts of accepted insertions undone by as many removals, with
+      // immediate and with delayed (rank-16) updates of the inverse.
+      for (int delay : {0, 16}) {
+        FastUpdate du(Delta, 0, 1e-8, delay, 0);
+        du.rebuild(c);
+        ns = time_ns([&](long) {
+          for (int n = 0; n < 16; n++) {
+            auto move = inserts[n];
+            sink = sink + du.ratio(move);
+            du.accept(move);
+          }
+          du.flush();
+          for (int n = 0; n < 16; n++) {
+            auto removal =
+                RemovalMove(index_of(du.t_i, du.k, inserts[n].t_i),
+                            index_of(du.t_f, du.k, inserts[n].t_f), 1.0);
+            sink = sink + du.ratio(removal);
+            du.accept(removal);
+          }
+        }) / 32.0;
+        results.push_back({delay > 0 ? "FastUpdate burst (delayed)"
+                                     : "FastUpdate burst (immediate)",
+                           beta, order, ns});
+      }
+
+      ns = time_ns([&](long) {
+        auto d = Determinant(c, e);
+        sink = sink + d.value;
+      });
+      results.push_back({"Determinant", beta, order, ns});
+
+      ns = time_ns([&](long) { S.sample_greens_function(cs); });
+      results.push_back({"Solver::sample_greens_function", beta, order, ns});
+    }
+
+    // Full Markov chain at the natural expansion order of this beta.
+    auto S = Solver(e, moves, 200, 30, 100, 4321);
+    S.verbose = false;
+    auto c = Configurations{
+        Configuration(nda::vector<double>{}, nda::vector<double>{})};
+    S.d[0].rebuild(c[0]);
+    for (int step = 0; step < 10000; step++) {
+      S.metropolis_hastings_update(c);
+    }
+    long steps = 0;
+    double order = 0.0;
+    ns = time_ns([&](long) {
+      S.metropolis_hastings_update(c);
+      order += expansion_order(c);
+      steps++;
+    }, 1.0);
+    results.push_back({"Solver::metropolis_hastings_update", beta,
+                       static_cast<int>(std::round(order / steps)), ns});
+
+    // Effective samples with and without the shift and flip moves.
+    int mean_order = static_cast<int>(std::round(order / steps));
+    results.push_back({"effective sample (insert, remove)", beta, mean_order,
+                       effective_sample_ns(e, c, moves)});
+    results.push_back(
+        {"effective sample (+shift)", beta, mean_order,
+         effective_sample_ns(
+             e, c,
+             MoveSet<NewSegmentInsertionMove, NewAntiSegmentInsertionMove,
+                     NewSegmentRemoveMove, NewAntiSegmentRemoveMove,
+                     NewShiftMove>())});
+    results.push_back(
+        {"effective sample (+shift, flip)", beta, mean_order,
+         effective_sample_ns(
+             e, c,
+             MoveSet<NewSegmentInsertionMove, NewAntiSegmentInsertionMove,
+                     NewSegmentRemoveMove, NewAntiSegmentRemoveMove,
+                     NewShiftMove, NewFlipMove>())});
+  }
+
+  std::cout << "benchmark                              beta  order      ns/op"
+            << "       ops/s" << std::endl;
+  for (auto &r : results) {
+    std::printf("%-36s %6.1f %6d %10.1f %11.0f\n", r.name.c_str(), r.beta,
+                r.order, r.ns_per_op, 1e9 / r.ns_per_op);
+  }
+
+  std::ofstream out(filename);
+  if (!out.is_open()) {
+    std::cerr << "Failed to open file!" << std::endl;
+    return 1;
+  }
+  out << "{\n  \"compiler\": \"" << __VERSION__ << "\",\n  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); i++) {
+    auto &r = results[i];
+    out << "    {\"name\": \"" << r.name << "\", \"beta\": " << r.beta
+        << ", \"order\": " << r.order << ", \"ns_per_op\": " << r.ns_per_op
+        << ", \"ops_per_sec\": " << 1e9 / r.ns_per_op << "}"
+        << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+  out.close();
+  return 0;
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <nda/nda.hpp>
+
+#include "checkpoint.hpp"
+
+namespace tinycthyb {
+
+// Online logarithmic binning of a vector observable x and the sign s, both
+// measured once per sampling epoch. Level l collects the averages of blocks of
+// 2^l measurements, so the memory is O(size * levels) however long the run.
+// The error of the ratio <x>/<s> follows from the block averages of one level
+// with the delta method, and the integrated autocorrelation time from how
+// that error grows with the block size.
+class Binning {
+public:
+  nda::matrix<double> sum_x;  // (level, i) sums of block averages
+  nda::matrix<double> sum_xx; // and of their squares
+  nda::matrix<double> sum_xs; // and of their products with the sign
+  nda::vector<double> sum_s;
+  nda::vector<double> sum_ss;
+  nda::vector<double> blocks; // completed blocks per level
+  int size;
+  int levels;
+
+  // Levels with fewer completed blocks do not give an error estimate.
+  static constexpr int min_blocks = 64;
+
+  Binning(int size, int levels = 32)
+      : sum_x(nda::zeros<double>(levels, size)),
+        sum_xx(nda::zeros<double>(levels, size)),
+        sum_xs(nda::zeros<double>(levels, size)),
+        sum_s(nda::zeros<double>(levels)), sum_ss(nda::zeros<double>(levels)),
+        blocks(nda::zeros<double>(levels)), size(size), levels(levels),
+        pending_x(nda::zeros<double>(levels, size)),
+        pending_s(nda::zeros<double>(levels)),
+        pending(nda::zeros<double>(levels)), scratch(nda::zeros<double>(size)) {}
+
+  // Sums of the completed blocks; the pending halves of independent chains
+  // are dropped.
+  Binning &operator+=(const Binning &other) {
+    sum_x += other.sum_x;
+    sum_xx += other.sum_xx;
+    sum_xs += other.sum_xs;
+    sum_s += other.sum_s;
+    sum_ss += other.sum_ss;
+    blocks += other.blocks;
+    return *this;
+  }
+
+  long count() const { return static_cast<long>(blocks(0)); }
+
+  void add(const double *x, double s) {
+    double *carry = scratch.data();
+    std::copy(x, x + size, carry);
+    for (int l = 0; l < levels; l++) {
+      for (int i = 0; i < size; i++) {
+        sum_x(l, i) += carry[i];
+        sum_xx(l, i) += carry[i] * carry[i];
+        sum_xs(l, i) += carry[i] * s;
+      }
+      sum_s(l) += s;
+      sum_ss(l) += s * s;
+      blocks(l) += 1;
+      if (pending(l) == 0.0) {
+        for (int i = 0; i < size; i++) {
+          pending_x(l, i) = carry[i];
+        }
+        pending_s(l) = s;
+        pending(l) = 1.0;
+        return;
+      }
+      for (int i = 0; i < size; i++) {
+        carry[i] = 0.5 * (carry[i] + pending_x(l, i));
+      }
+      s = 0.5 * (s + pending_s(l));
+      pending(l) = 0.0;
+    }
+  }
+
+  // <x_i> / <s>.
+  nda::vector<double> ratio() const {
+    auto r = nda::zeros<double>(size);
+    for (int i = 0; i < size; i++) {
+      r(i) = sum_x(0, i) / sum_s(0);
+    }
+    return r;
+  }
+
+  double sign() const { return blocks(0) > 0 ? sum_s(0) / blocks(0) : 0.0; }
+
+  // The highest level with at least min_blocks blocks, -1 if there is none.
+  int level() const {
+    int l = -1;
+    while (l + 1 < levels && blocks(l + 1) >= min_blocks) {
+      l++;
+    }
+    return l;
+  }
+
+  // Delta method error of <x_i> / <s> from the blocks of level l.
+  nda::vector<double> error(int l) const {
+    auto err = nda::zeros<double>(size);
+    double M = l < 0 ? 0.0 : blocks(l);
+    if (M < 2) {
+      return err;
+    }
+    double S = sum_s(l) / M;
+    double var_s = (sum_ss(l) / M - S * S) * M / (M - 1);
+    for (int i = 0; i < size; i++) {
+      double X = sum_x(l, i) / M;
+      double var_x = (sum_xx(l, i) / M - X * X) * M / (M - 1);
+      double cov = (sum_xs(l, i) / M - X * S) * M / (M - 1);
+      double var = (var_x / (S * S) - 2.0 * X * cov / (S * S * S) +
+                    X * X * var_s / (S * S * S * S)) /
+                   M;
+      err(i) = std::sqrt(std::max(var, 0.0));
+    }
+    return err;
+  }
+
+  nda::vector<double> error() const { return error(level()); }
+
+  double sign_error() const {
+    int l = level();
+    double M = l < 0 ? 0.0 : blocks(l);
+    if (M < 2) {
+      return 0.0;
+    }
+    double S = sum_s(l) / M;
+    return std::sqrt(std::max((sum_ss(l) / M - S * S) / (M - 1), 0.0));
+  }
+
+  // tau_int = (error at the binning level / error without binning)^2 / 2 in
+  // units of sampling epochs.
+  nda::vector<double> autocorrelation_time() const {
+    auto tau = nda::zeros<double>(size);
+    auto err = error();
+    auto err0 = error(0);
+    for (int i = 0; i < size; i++) {
+      if (err0(i) > 0.0) {
+        tau(i) = 0.5 * (err(i) * err(i)) / (err0(i) * err0(i));
+      }
+    }
+    return tau;
+  }
+
+  // Half-filled block waiting at each level, kept so that a checkpointed
+  // chain continues with the same blocks.
+  nda::matrix<double> pending_x;
+  nda::vector<double> pending_s;
+  nda::vector<double> pending;
+
+private:
+  nda::vector<double> scratch;
+};
+
+void write_binning(std::ostream &out, const Binning &b) {
+  write_matrix(out, b.sum_x);
+  write_matrix(out, b.sum_xx);
+  write_matrix(out, b.sum_xs);
+  write_vector(out, b.sum_s);
+  write_vector(out, b.sum_ss);
+  write_vector(out, b.blocks);
+  write_matrix(out, b.pending_x);
+  write_vector(out, b.pending_s);
+  write_vector(out, b.pending);
+}
+
+// Reads into b, which must have the size and levels of the written one.
+bool read_binning(std::istream &in, Binning &b) {
+  return read_matrix(in, b.sum_x) && read_matrix(in, b.sum_xx) &&
+         read_matrix(in, b.sum_xs) && read_vector(in, b.sum_s, b.levels) &&
+         read_vector(in, b.sum_ss, b.levels) &&
+         read_vector(in, b.blocks, b.levels) &&
+         read_matrix(in, b.pending_x) &&
+         read_vector(in, b.pending_s, b.levels) &&
+         read_vector(in, b.pending, b.levels);
+}
+
+} // namespace tinycthyb
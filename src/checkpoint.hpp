@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <nda/nda.hpp>
+#include <string>
+#include <type_traits>
+
+#include "configuration.hpp"
+
+namespace tinycthyb {
+
+// Binary checkpoints are written in native byte order, with every array
+// preceded by its length. The header and the configurations come first, so
+// that a thermalized configuration can be read on its own with
+// read_configurations.
+constexpr std::uint64_t checkpoint_magic = 0x324b504348544354; // "TCTHCPK2"
+
+template <typename T> void write_value(std::ostream &out, const T &value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T> bool read_value(std::istream &in, T &value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  in.read(reinterpret_cast<char *>(&value), sizeof(T));
+  return static_cast<bool>(in);
+}
+
+// Writes the first n entries of v.
+template <typename T>
+void write_vector(std::ostream &out, const nda::vector<T> &v, long n) {
+  write_value(out, n);
+  out.write(reinterpret_cast<const char *>(v.data()), n * sizeof(T));
+}
+
+template <typename T>
+void write_vector(std::ostream &out, const nda::vector<T> &v) {
+  write_vector(out, v, v.size());
+}
+
+// Reads a vector written by write_vector, which must have n entries unless n
+// is negative.
+template <typename T>
+bool read_vector(std::istream &in, nda::vector<T> &v, long n = -1) {
+  long size;
+  if (!read_value(in, size) || size < 0 || (n >= 0 && size != n)) {
+    return false;
+  }
+  v = nda::zeros<T>(size);
+  in.read(reinterpret_cast<char *>(v.data()), size * sizeof(T));
+  return static_cast<bool>(in);
+}
+
+template <typename T>
+void write_matrix(std::ostream &out, const nda::matrix<T> &m) {
+  write_value(out, static_cast<long>(m.shape()[0]));
+  write_value(out, static_cast<long>(m.shape()[1]));
+  out.write(reinterpret_cast<const char *>(m.data()), m.size() * sizeof(T));
+}
+
+// Reads a matrix written by write_matrix into m, whose shape it must have.
+template <typename T> bool read_matrix(std::istream &in, nda::matrix<T> &m) {
+  long rows, cols;
+  if (!read_value(in, rows) || !read_value(in, cols) ||
+      rows != m.shape()[0] || cols != m.shape()[1]) {
+    return false;
+  }
+  in.read(reinterpret_cast<char *>(m.data()), m.size() * sizeof(T));
+  return static_cast<bool>(in);
+}
+
+void write_configurations(std::ostream &out, const Configurations &c,
+                          double beta) {
+  write_value(out, checkpoint_magic);
+  write_value(out, beta);
+  write_value(out, static_cast<long>(c.size()));
+  for (auto &ca : c) {
+    write_vector(out, ca.t_i, ca.length());
+    write_vector(out, ca.t_f, ca.length());
+  }
+}
+
+bool read_configurations(std::istream &in, Configurations &c, double &beta) {
+  std::uint64_t magic;
+  long flavors;
+  if (!read_value(in, magic) || magic != checkpoint_magic ||
+      !read_value(in, beta) || !read_value(in, flavors) || flavors < 0) {
+    return false;
+  }
+  c.clear();
+  for (long a = 0; a < flavors; a++) {
+    nda::vector<double> t_i, t_f;
+    if (!read_vector(in, t_i) || !read_vector(in, t_f, t_i.size())) {
+      return false;
+    }
+    c.emplace_back(t_i, t_f);
+  }
+  return true;
+}
+
+// Only the configurations and the inverse temperature of a checkpoint, e.g. to
+// start a run with nearby parameters from a thermalized state.
+int read_configurations(std::string filename, Configurations &c,
+                        double &beta) {
+  std::ifstream in(filename, std::ios::binary);
+  if (!in.is_open()) {
+    std::cerr << "Failed to open file!" << std::endl;
+    return 1;
+  }
+  if (!read_configurations(in, c, beta)) {
+    std::cerr << "Invalid checkpoint file!" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+} // namespace tinycthyb
@@ -1,7 +1,10 @@
 #pragma once
 
 #include "iostream"
+#include <algorithm>
+#include <limits>
 #include <nda/nda.hpp>
+#include <vector>
 
 #include "util.hpp"
 
@@ -11,60 +14,311 @@ struct InsertMove {
   double t_i;
   double t_f;
   double l;
-  InsertMove(double t_i, double t_f, double l) : t_i(t_i), t_f(t_f), l(l) {}
+  int flavor;
+  InsertMove(double t_i, double t_f, double l, int flavor = 0)
+      : t_i(t_i), t_f(t_f), l(l), flavor(flavor) {}
 };
 
 struct RemovalMove {
   int i_idx;
   int f_idx;
   double l;
-  RemovalMove(int i_idx, int f_idx, double l) : i_idx(i_idx), f_idx(f_idx), l(l) {}
+  int flavor;
+  RemovalMove(int i_idx, int f_idx, double l, int flavor = 0)
+      : i_idx(i_idx), f_idx(f_idx), l(l), flavor(flavor) {}
 };
 
+// Moves the creator (or annihilator) at sorted index idx to time t, within
+// the interval of length l between its neighbours of the other kind.
+struct ShiftMove {
+  int idx;
+  bool creator;
+  double t;
+  double l;
+  int flavor;
+  ShiftMove(int idx, bool creator, double t, double l, int flavor = 0)
+      : idx(idx), creator(creator), t(t), l(l), flavor(flavor) {}
+};
+
+// Exchanges creators and annihilators of one flavor, turning its segments
+// into antisegments and vice versa.
+struct FlipMove {
+  int flavor;
+  FlipMove(int flavor = 0) : flavor(flavor) {}
+};
+
+// Exchanges the configurations of flavors a and b.
+struct SwapMove {
+  int a;
+  int b;
+  SwapMove(int a, int b) : a(a), b(b) {}
+};
+
+// Operator times are kept sorted in preallocated storage; only the first
+// length() entries of t_i and t_f are valid, and they double as the ordered
+// index used to locate segments. Moves are applied in place as a trial and
+// then either committed or rolled back.
 struct Configuration {
   nda::vector<double> t_i;
   nda::vector<double> t_f;
 
-  Configuration(nda::vector<double> t_i_, nda::vector<double> t_f_) {
-    if (i.size() == 0) {
-      t_i = nda::vector<double>{};
-      t_f = nda::vector<double>{};
-    }
+  Configuration(nda::vector<double> t_i_, nda::vector<double> t_f_,
+                int capacity = 64)
+      : k(t_i_.size()), cap(0), t_sum(0.0) {
     std::sort(t_i_.begin(), t_i_.end());
     std::sort(t_f_.begin(), t_f_.end());
-    t_i = t_i_;
-    t_f = t_f_;
+    reserve(std::max(capacity, k));
+    for (int i = 0; i < k; i++) {
+      t_i(i) = t_i_(i);
+      t_f(i) = t_f_(i);
+      t_sum += t_f(i) - t_i(i);
+    }
+  }
+
+  int length() const { return k; }
+
+  // Total length of all segments, kept up to date by every move.
+  double occupation(double beta) const {
+    if (k == 0) {
+      return 0.0;
+    }
+    return (t_f(0) < t_i(0)) ? t_sum + beta : t_sum;
+  }
+
+  // Indices of the last t_i and the last t_f before t, -1 if there is none.
+  std::pair<int, int> preceding(double t) const {
+    int i_idx = std::distance(t_i.begin(),
+                              std::lower_bound(t_i.begin(), t_i.begin() + k, t));
+    int f_idx = std::distance(t_f.begin(),
+                              std::lower_bound(t_f.begin(), t_f.begin() + k, t));
+    return std::make_pair(i_idx - 1, f_idx - 1);
   }
 
-  // Assignment operator for copying
-  Configuration &operator=(const Configuration &other) {
-    if (this != &other) {
-      t_i = other.t_i;
-      t_f = other.t_f;
+  // Whether t lies on a segment, i.e. the last operator before t (cyclically)
+  // is a t_i.
+  bool occupied(double t) const {
+    if (k == 0) {
+      return false;
+    }
+    auto [i_idx, f_idx] = preceding(t);
+    if (i_idx >= 0 && f_idx >= 0) {
+      return t_i(i_idx) > t_f(f_idx);
+    } else if (i_idx >= 0 || f_idx >= 0) {
+      return i_idx >= 0;
     }
-    return *this;
+    return t_i(k - 1) > t_f(k - 1);
+  }
+
+  // Occupied length between t1 and t2, going cyclically from t1 to t2. Walks
+  // only the operators inside the interval.
+  double overlap(double t1, double t2, double beta) const {
+    if (k == 0) {
+      return 0.0;
+    }
+    if (t1 <= t2) {
+      return overlap(t1, t2);
+    }
+    return overlap(t1, beta) + overlap(0.0, t2);
   }
 
-  int length() const { return t_i.size(); }
   void print() const {
-    std::cout << "Configuration(" << t_i << ", " << t_f << ")" << std::endl;
+    std::cout << "Configuration(";
+    for (int i = 0; i < k; i++) {
+      std::cout << t_i(i) << " ";
+    }
+    std::cout << ", ";
+    for (int i = 0; i < k; i++) {
+      std::cout << t_f(i) << " ";
+    }
+    std::cout << ")" << std::endl;
+  }
+
+  void insert(InsertMove &move) {
+    reserve(k + 1);
+    trial = Trial::Insert;
+    trial_i_idx = insert_sorted(t_i, move.t_i);
+    trial_f_idx = insert_sorted(t_f, move.t_f);
+    t_sum += move.t_f - move.t_i;
+    k++;
+  }
+
+  void remove(RemovalMove &move) {
+    trial = Trial::None;
+    if (move.i_idx < 0 || k == 0) {
+      return;
+    }
+    trial = Trial::Remove;
+    trial_t_i = t_i(move.i_idx);
+    trial_t_f = t_f(move.f_idx);
+    erase(t_i, move.i_idx);
+    erase(t_f, move.f_idx);
+    t_sum -= trial_t_f - trial_t_i;
+    k--;
+    if (k == 0) {
+      t_sum = 0.0;
+    }
   }
 
-  Configuration operator+(InsertMove &move) {
-    nda::vector<double> new_t_i = hstack(t_i, move.t_i);
-    nda::vector<double> new_t_f = hstack(t_f, move.t_f);
-    return Configuration(new_t_i, new_t_f);
+  void shift(ShiftMove &move) {
+    auto &t = move.creator ? t_i : t_f;
+    trial = Trial::Shift;
+    trial_creator = move.creator;
+    trial_t_i = t(move.idx);
+    erase(t, move.idx);
+    k--;
+    trial_i_idx = insert_sorted(t, move.t);
+    k++;
+    t_sum += move.creator ? trial_t_i - move.t : move.t - trial_t_i;
   }
 
-  Configuration operator+(RemovalMove &move) {
-    if (move.i_idx >= 0 && length() > 0) {
-      nda::vector<double> new_t_i = deleteat(t_i, move.i_idx);
-      nda::vector<double> new_t_f = deleteat(t_f, move.f_idx);
-      return Configuration(new_t_i, new_t_f);
-    } else {
-      return *this;
+  // Self-inverse, so it is undone by flipping again.
+  void flip() {
+    std::swap(t_i, t_f);
+    t_sum = -t_sum;
+    trial = Trial::None;
+  }
+
+  void commit() { trial = Trial::None; }
+
+  void rollback() {
+    if (trial == Trial::Insert) {
+      t_sum -= t_f(trial_f_idx) - t_i(trial_i_idx);
+      erase(t_i, trial_i_idx);
+      erase(t_f, trial_f_idx);
+      k--;
+    } else if (trial == Trial::Remove) {
+      insert_sorted(t_i, trial_t_i);
+      insert_sorted(t_f, trial_t_f);
+      t_sum += trial_t_f - trial_t_i;
+      k++;
+    } else if (trial == Trial::Shift) {
+      auto &t = trial_creator ? t_i : t_f;
+      double moved = t(trial_i_idx);
+      erase(t, trial_i_idx);
+      k--;
+      insert_sorted(t, trial_t_i);
+      k++;
+      t_sum += trial_creator ? moved - trial_t_i : trial_t_i - moved;
+    }
+    trial = Trial::None;
+  }
+
+  Configuration operator+(InsertMove &move) const {
+    Configuration cnew = *this;
+    cnew.insert(move);
+    cnew.commit();
+    return cnew;
+  }
+
+  Configuration operator+(RemovalMove &move) const {
+    Configuration cnew = *this;
+    cnew.remove(move);
+    cnew.commit();
+    return cnew;
+  }
+
+private:
+  enum class Trial { None, Insert, Remove, Shift };
+
+  int k;
+  int cap;
+  double t_sum; // sum of t_f minus sum of t_i
+  Trial trial = Trial::None;
+  int trial_i_idx = 0;
+  int trial_f_idx = 0;
+  double trial_t_i = 0.0;
+  double trial_t_f = 0.0;
+  bool trial_creator = false;
+
+  double overlap(double t1, double t2) const {
+    constexpr double inf = std::numeric_limits<double>::infinity();
+    bool n = occupied(t1);
+    auto [i_idx, f_idx] = preceding(t1);
+    i_idx++;
+    f_idx++;
+    double t = t1;
+    double sum = 0.0;
+    while (true) {
+      double next_i = i_idx < k ? t_i(i_idx) : inf;
+      double next_f = f_idx < k ? t_f(f_idx) : inf;
+      double next = std::min({next_i, next_f, t2});
+      if (n) {
+        sum += next - t;
+      }
+      if (next == t2) {
+        return sum;
+      }
+      t = next;
+      if (next_i < next_f) {
+        n = true;
+        i_idx++;
+      } else {
+        n = false;
+        f_idx++;
+      }
+    }
+  }
+
+  void reserve(int n) {
+    if (n <= cap) {
+      return;
+    }
+    int new_cap = std::max(n, 2 * cap);
+    nda::vector<double> new_t_i = nda::zeros<double>(new_cap);
+    nda::vector<double> new_t_f = nda::zeros<double>(new_cap);
+    for (int i = 0; i < k && i < cap; i++) {
+      new_t_i(i) = t_i(i);
+      new_t_f(i) = t_f(i);
+    }
+    t_i = new_t_i;
+    t_f = new_t_f;
+    cap = new_cap;
+  }
+
+  // Inserts into the first k entries of t, which must have room for one more.
+  int insert_sorted(nda::vector<double> &t, double value) {
+    int idx = std::distance(t.begin(),
+                            std::lower_bound(t.begin(), t.begin() + k, value));
+    for (int i = k; i > idx; i--) {
+      t(i) = t(i - 1);
+    }
+    t(idx) = value;
+    return idx;
+  }
+
+  void erase(nda::vector<double> &t, int idx) {
+    for (int i = idx; i < k - 1; i++) {
+      t(i) = t(i + 1);
     }
   }
 };
 
+// One configuration per flavor; the hybridization is diagonal in flavor so the
+// flavors only couple through the local trace.
+using Configurations = std::vector<Configuration>;
+
+int expansion_order(const Configurations &c) {
+  int k = 0;
+  for (auto &ca : c) {
+    k += ca.length();
+  }
+  return k;
+}
+
+// Operator times of c scaled by factor, which maps a configuration at one
+// beta onto the interval of another.
+Configurations rescale(const Configurations &c, double factor) {
+  Configurations out;
+  for (auto &ca : c) {
+    auto t_i = nda::zeros<double>(ca.length());
+    auto t_f = nda::zeros<double>(ca.length());
+    for (int i = 0; i < ca.length(); i++) {
+      t_i(i) = factor * ca.t_i(i);
+      t_f(i) = factor * ca.t_f(i);
+    }
+    out.emplace_back(t_i, t_f);
+  }
+  return out;
+}
+
 } // namespace tinycthyb
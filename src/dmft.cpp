@@ -0,0 +1,60 @@
+#include "dmft.hpp"
+#include "green.hpp"
+#include "parallel.hpp"
+#include "solver.hpp"
+#include <random>
+#include <thread>
+
+using namespace tinycthyb;
+
+// Paramagnetic Hubbard model on the Bethe lattice at half filling, started
+// from the non-interacting hybridization.
+int main(int argc, char *argv[]) {
+
+  mpi::environment env(argc, argv);
+  mpi::communicator world;
+
+  double beta = 20;
+  double U0 = 2.0;
+  int nt = 200;
+  auto times = nda::zeros<double>(nt);
+  for (int i = 0; i < nt; i++) {
+    times(i) = beta * (double)i / (nt - 1);
+  }
+
+  auto g_ref = read_semi_circular_g_tau(nt);
+  if (!g_ref) {
+    return 1;
+  }
+  std::vector<Hybridization> Delta{
+      Hybridization(times, -0.25 * g_ref->data, beta)};
+
+  nda::matrix<double> U = nda::zeros<double>(2, 2);
+  U(0, 1) = U(1, 0) = U0;
+  auto e = Expansion(beta, nda::vector<double>{-U0 / 2, -U0 / 2}, U,
+                     {Delta[0], Delta[0]});
+
+  auto moves = MoveSet<NewSegmentInsertionMove, NewAntiSegmentInsertionMove,
+                       NewSegmentRemoveMove, NewAntiSegmentRemoveMove,
+                       NewShiftMove>();
+  auto c = Configurations(
+      2, Configuration(nda::vector<double>{}, nda::vector<double>{}));
+  int n_legendre = 30;
+  int n_matsubara = 100;
+  auto S = Solver(e, moves, nt, n_legendre, n_matsubara);
+
+  DMFT p;
+  p.tolerance = 5e-3;
+  p.conv.tolerance = 0.01;
+  p.conv.max_sampling_epochs = 1000000;
+  int n_threads = std::max(1u, std::thread::hardware_concurrency());
+  solve_dmft(S, Delta, c, p, n_threads, std::random_device{}(), world);
+  if (world.rank() == 0) {
+    S.g[0].write_data("gmeasure.txt");
+    S.gl[0].write_data("gl.txt");
+    S.giw[0].write_data("giw.txt");
+    write_self_energy("sigma.txt", S.giw[0], S.fiw[0]);
+    S.write_occupations("occupation.txt");
+  }
+  return 0;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <mpi/mpi.hpp>
+#include <nda/nda.hpp>
+#include <vector>
+
+#include "configuration.hpp"
+#include "hybridization.hpp"
+#include "parallel.hpp"
+#include "solver.hpp"
+
+namespace tinycthyb {
+
+// Self-consistency on the Bethe lattice with half bandwidth 2t, where the
+// hybridization is Delta(tau) = -t^2 G(tau) in the sign convention of
+// Hybridization.
+struct DMFT {
+  double t = 0.5;
+  // Weight of the new hybridization against the old one.
+  double mixing = 1.0;
+  int max_iterations = 20;
+  // The loop stops once no value of Delta(tau) changes by more than
+  // tolerance.
+  double tolerance = 1e-3;
+  // Sampling of the first iteration, which starts from the given
+  // configuration. Later iterations continue the chains of the one before
+  // with at most warm_warmup_epochs of warmup, and sample until the G(tau)
+  // error is below error_fraction times the last change of Delta / t^2,
+  // which tightens as the loop converges, but not below tolerance / 2.
+  Convergence conv;
+  int warm_warmup_epochs = 200;
+  double error_fraction = 0.2;
+};
+
+// Iterates S to self-consistency. Delta holds the hybridizations of the
+// expansion of S, which are replaced in place after every iteration by the
+// average -t^2 G(tau) of the flavors sharing them, from the Legendre
+// coefficients when S measures them. Returns whether the loop converged.
+template <typename Moves>
+bool solve_dmft(Solver<Moves> &S, std::vector<Hybridization> &Delta,
+                Configurations c, const DMFT &p, int n_threads,
+                std::uint64_t seed, mpi::communicator comm = {}) {
+  Chains chains;
+  double change = std::numeric_limits<double>::infinity();
+  double target = std::numeric_limits<double>::infinity();
+  double t2 = p.t * p.t;
+
+  for (int iteration = 0; iteration < p.max_iterations; iteration++) {
+    auto conv = p.conv;
+    if (iteration > 0) {
+      target = std::min(target, std::max(p.error_fraction * change,
+                                         0.5 * p.tolerance) /
+                                    t2);
+      conv.tolerance = target;
+      conv.min_warmup_epochs = 0;
+      conv.max_warmup_epochs = p.warm_warmup_epochs;
+    }
+    S.reset();
+    solve_parallel(S, c, n_threads, seed, comm, conv, &chains);
+
+    change = 0.0;
+    for (auto &D : Delta) {
+      auto G = nda::zeros<double>(D.times.size());
+      int n = 0;
+      for (int a = 0; a < S.expansion().flavors(); a++) {
+        if (&S.d[a].Delta != &D) {
+          continue;
+        }
+        if (S.gl[a].N > 0) {
+          G += S.gl[a].evaluate(D.times);
+        } else {
+          G += S.g[a].evaluate(D.times);
+        }
+        n++;
+      }
+      if (n == 0) {
+        continue;
+      }
+      nda::vector<double> values =
+          -p.mixing * t2 / n * G + (1.0 - p.mixing) * D.values;
+      for (int i = 0; i < values.size(); i++) {
+        change = std::max(change, std::abs(values(i) - D.values(i)));
+      }
+      D = Hybridization(D.times, values, D.beta);
+    }
+
+    if (S.verbose && comm.rank() == 0) {
+      std::cout << "DMFT iteration " << iteration << ": max Delta(tau) change "
+                << change << ", G(tau) error " << S.max_error() << std::endl;
+    }
+    if (change < p.tolerance) {
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace tinycthyb
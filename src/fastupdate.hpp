@@ -0,0 +1,723 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <nda/blas.hpp>
+#include <nda/lapack.hpp>
+#include <nda/nda.hpp>
+#include <stdexcept>
+#include <vector>
+
+#include "aligned.hpp"
+#include "configuration.hpp"
+#include "hybridization.hpp"
+
+namespace tinycthyb {
+
+// Persistent inverse of the hybridization matrix mat(j, i) = Delta(t_f(j) - t_i(i)),
+// with t_i and t_f kept in sorted order. Acceptance ratios are computed from
+// the Schur complement and the inverse is only updated when a move is accepted.
+//
+// From order delay_order on, accepted insertions are buffered instead: M stays
+// the inverse of the first k operators, and the pending rows and columns are
+// carried by U = M B, the new rows C of mat and the inverse Sinv of their
+// Schur complement. flush applies up to delay of them at once as a rank-m
+// update with matrix-matrix products, which replaces m passes over M by one.
+// Removal ratios are read off the buffered inverse; everything else flushes
+// first, so t_i, t_f, M and k are only complete after flush.
+class FastUpdate {
+public:
+  Hybridization &Delta;
+  AlignedVector<double> t_i;
+  AlignedVector<double> t_f;
+  AlignedMatrix<double> M; // M(i, j): rows follow t_i, columns follow t_f
+  LogValue det;          // determinant of mat in sorted order, with pending
+  int k;
+  int recompute_period;
+  double tolerance;
+  double max_drift;
+  int delay;       // most buffered insertions, < 2 updates immediately
+  int delay_order; // smallest order at which insertions are buffered
+
+  FastUpdate(Hybridization &Delta, int recompute_period = 100,
+             double tolerance = 1e-8, int delay = 16, int delay_order = 64)
+      : Delta(Delta), k(0), recompute_period(recompute_period),
+        tolerance(tolerance), max_drift(0.0), delay(delay),
+        delay_order(delay_order), cap(0), n_updates(0), n_pending(0) {
+    reserve(16);
+  }
+
+  void rebuild(Configuration &c) {
+    k = 0;
+    n_pending = 0;
+    reserve(c.length());
+    for (int i = 0; i < c.length(); i++) {
+      t_i(i) = c.t_i(i);
+      t_f(i) = c.t_f(i);
+    }
+    k = c.length();
+    if (recompute() == std::numeric_limits<double>::infinity()) {
+      // A singular matrix: the configuration has weight zero.
+      det = LogValue(-std::numeric_limits<double>::infinity(), 0);
+    }
+  }
+
+  // Determinant with the segment ordering used by Determinant, i.e. t_f rolled
+  // so that the winding segment comes last.
+  LogValue value() const {
+    int n = k + n_pending;
+    if (n == 0) {
+      return det;
+    }
+    double first_i = k > 0 ? t_i(0) : pend_i(0);
+    double first_f = k > 0 ? t_f(0) : pend_f(0);
+    for (int a = 0; a < n_pending; a++) {
+      first_i = std::min(first_i, pend_i(a));
+      first_f = std::min(first_f, pend_f(a));
+    }
+    bool wrap = first_f < first_i;
+    return (wrap && n % 2 == 0) ? LogValue(det.log, -det.sign) : det;
+  }
+
+  int order() const { return k + n_pending; }
+
+  double ratio(InsertMove &move) {
+    if (n_pending > 0 && n_pending >= delay) {
+      flush();
+    }
+    reserve(k + 1);
+    Delta.column(t_f.data(), k, move.t_i, b.data());
+    Delta.row(move.t_f, t_i.data(), k, c.data());
+    for (int i = 0; i < k; i++) {
+      const double *Mi = &M(i, 0);
+      double s = 0.0;
+#pragma omp simd reduction(+ : s)
+      for (int j = 0; j < k; j++) {
+        s += Mi[j] * b(j);
+      }
+      Mb(i) = s;
+    }
+    double S = Delta(move.t_f - move.t_i);
+    for (int i = 0; i < k; i++) {
+      S -= c(i) * Mb(i);
+    }
+    pi = position(t_i, move.t_i);
+    pf = position(t_f, move.t_f);
+    if (n_pending > 0) {
+      // S - q Sinv p with p = C M b - b_pending and q = c M B - c_pending.
+      for (int a = 0; a < n_pending; a++) {
+        double pa = -Delta(pend_f(a) - move.t_i);
+        double qa = -Delta(move.t_f - pend_i(a));
+        for (int i = 0; i < k; i++) {
+          pa += C(a, i) * Mb(i);
+          qa += c(i) * U(i, a);
+        }
+        p(a) = pa;
+        q(a) = qa;
+        pi += pend_i(a) < move.t_i;
+        pf += pend_f(a) < move.t_f;
+      }
+      for (int a = 0; a < n_pending; a++) {
+        double s = 0.0;
+        for (int b = 0; b < n_pending; b++) {
+          s += Sinv(a, b) * p(b);
+        }
+        Sp(a) = s;
+        S -= q(a) * s;
+      }
+    }
+    schur = S;
+    return ((pi + pf) % 2 == 0) ? S : -S;
+  }
+
+  double ratio(RemovalMove &move) {
+    pi = move.i_idx;
+    pf = move.f_idx;
+    double r = n_pending > 0 ? pending_inverse(pi, pf) : M(pi, pf);
+    return ((pi + pf) % 2 == 0) ? r : -r;
+  }
+
+  void accept(InsertMove &move) {
+    if (n_pending > 0 || (delay > 1 && k >= delay_order)) {
+      buffer(move);
+      return;
+    }
+    row_times_M(c.data(), cM.data());
+    double S = 1.0 / schur;
+
+    // Fill the enlarged inverse in place, moving from the bottom-right so that
+    // the new row and column land at their sorted positions pi and pf.
+    for (int r = k; r >= 0; r--) {
+      int r_old = r < pi ? r : r - 1;
+      for (int s = k; s >= 0; s--) {
+        int s_old = s < pf ? s : s - 1;
+        if (r == pi && s == pf) {
+          M(r, s) = S;
+        } else if (r == pi) {
+          M(r, s) = -S * cM(s_old);
+        } else if (s == pf) {
+          M(r, s) = -S * Mb(r_old);
+        } else {
+          M(r, s) = M(r_old, s_old) + S * Mb(r_old) * cM(s_old);
+        }
+      }
+    }
+    for (int i = k; i > pi; i--) {
+      t_i(i) = t_i(i - 1);
+    }
+    t_i(pi) = move.t_i;
+    for (int j = k; j > pf; j--) {
+      t_f(j) = t_f(j - 1);
+    }
+    t_f(pf) = move.t_f;
+
+    det *= ((pi + pf) % 2 == 0) ? schur : -schur;
+    k++;
+    check_drift();
+  }
+
+  void accept(RemovalMove &move) {
+    flush();
+    double S = M(pi, pf);
+    det *= ((pi + pf) % 2 == 0) ? S : -S;
+    for (int i = 0; i < k; i++) {
+      Mb(i) = M(i, pf);
+    }
+    for (int j = 0; j < k; j++) {
+      cM(j) = M(pi, j) / S;
+    }
+
+    for (int r = 0; r < k - 1; r++) {
+      int r_old = r < pi ? r : r + 1;
+      for (int s = 0; s < k - 1; s++) {
+        int s_old = s < pf ? s : s + 1;
+        M(r, s) = M(r_old, s_old) - Mb(r_old) * cM(s_old);
+      }
+    }
+    for (int i = pi; i < k - 1; i++) {
+      t_i(i) = t_i(i + 1);
+    }
+    for (int j = pf; j < k - 1; j++) {
+      t_f(j) = t_f(j + 1);
+    }
+
+    k--;
+    if (k == 0) {
+      det = LogValue();
+    }
+    check_drift();
+  }
+
+  // Moving a t_f changes one row of mat and moving a t_i one column, so the
+  // ratio is the new row (column) against the matching column (row) of M. The
+  // operator keeps its place in the sorted order unless it crosses beta, in
+  // which case it is rotated to the other end.
+  double ratio(ShiftMove &move) {
+    flush();
+    double r = 0.0;
+    if (move.creator) {
+      Delta.column(t_f.data(), k, move.t, b.data());
+      for (int j = 0; j < k; j++) {
+        r += M(move.idx, j) * b(j);
+      }
+      pi = position(t_i, move.t);
+      pi = pi > move.idx ? pi - 1 : pi;
+    } else {
+      Delta.row(move.t, t_i.data(), k, c.data());
+      for (int i = 0; i < k; i++) {
+        r += c(i) * M(i, move.idx);
+      }
+      pi = position(t_f, move.t);
+      pi = pi > move.idx ? pi - 1 : pi;
+    }
+    schur = r;
+    return (std::abs(pi - move.idx) % 2 == 0) ? r : -r;
+  }
+
+  void accept(ShiftMove &move) {
+    int idx = move.idx;
+    if (move.creator) {
+      for (int r = 0; r < k; r++) {
+        const double *Mr = &M(r, 0);
+        double s = r == idx ? -1.0 : 0.0;
+#pragma omp simd reduction(+ : s)
+        for (int j = 0; j < k; j++) {
+          s += Mr[j] * b(j);
+        }
+        Mb(r) = s;
+      }
+      for (int j = 0; j < k; j++) {
+        cM(j) = M(idx, j);
+      }
+    } else {
+      row_times_M(c.data(), cM.data());
+      cM(idx) -= 1.0;
+      for (int i = 0; i < k; i++) {
+        Mb(i) = M(i, idx);
+      }
+    }
+    for (int r = 0; r < k; r++) {
+      double *Mr = &M(r, 0);
+      double x = Mb(r) / schur;
+#pragma omp simd
+      for (int s = 0; s < k; s++) {
+        Mr[s] -= x * cM(s);
+      }
+    }
+
+    det *= (std::abs(pi - idx) % 2 == 0) ? schur : -schur;
+    if (move.creator) {
+      t_i(idx) = move.t;
+      rotate_row(idx, pi);
+    } else {
+      t_f(idx) = move.t;
+      rotate_column(idx, pi);
+    }
+    check_drift();
+  }
+
+  // Exchanging t_i and t_f builds a new matrix, O(k^3), whose inverse is
+  // kept in full until accepted.
+  double ratio(FlipMove &) {
+    flush();
+    for (int j = 0; j < k; j++) {
+      Delta.row(t_i(j), t_f.data(), k, &full(j, 0));
+    }
+    flip_det = invert_full();
+    return (flip_det / det).value();
+  }
+
+  void accept(FlipMove &) {
+    std::swap(t_i, t_f);
+    std::swap(M, full);
+    det = flip_det;
+    check_drift();
+  }
+
+  // Determinant of the matrix of configuration c with this hybridization, in
+  // the ordering of value(). Uses the scratch of ratio(FlipMove), so it must
+  // not come between that and its accept.
+  LogValue determinant(Configuration &c) {
+    int n = c.length();
+    if (n == 0) {
+      return LogValue();
+    }
+    reserve(n);
+    for (int j = 0; j < n; j++) {
+      Delta.row(c.t_f(j), c.t_i.data(), n, &full(j, 0));
+    }
+    LogValue value = factorize_full(n);
+    bool wrap = c.t_f(0) < c.t_i(0);
+    return (wrap && n % 2 == 0) ? LogValue(value.log, -value.sign) : value;
+  }
+
+  // Exchanges the state with other, which is only consistent when both use
+  // the same hybridization. The buffers sized by delay stay with each side, so
+  // both must have the same delay.
+  void swap(FastUpdate &other) {
+    if (delay != other.delay) {
+      throw std::invalid_argument("FastUpdate::swap with a different delay");
+    }
+    flush();
+    other.flush();
+    std::swap(t_i, other.t_i);
+    std::swap(t_f, other.t_f);
+    std::swap(M, other.M);
+    std::swap(det, other.det);
+    std::swap(k, other.k);
+    std::swap(b, other.b);
+    std::swap(c, other.c);
+    std::swap(Mb, other.Mb);
+    std::swap(cM, other.cM);
+    std::swap(U, other.U);
+    std::swap(C, other.C);
+    std::swap(V, other.V);
+    std::swap(full, other.full);
+    std::swap(ipiv, other.ipiv);
+    std::swap(work, other.work);
+    std::swap(cap, other.cap);
+  }
+
+  // Applies the buffered insertions to M, t_i and t_f.
+  void flush() {
+    int m = n_pending;
+    if (m == 0) {
+      return;
+    }
+    int n = k + m;
+    reserve(n);
+    int ld = M.stride();
+    int ldu = U.stride();
+    int ldc = C.stride();
+
+    // V = C M, W = Sinv V (into C) and M += U W: the block of the old rows and
+    // columns of the full inverse.
+    if (k > 0) {
+      gemm(m, k, k, 1.0, C.data(), ldc, M.data(), ld, 0.0, V.data(), ldc);
+      gemm(m, k, m, 1.0, Sinv.data(), Sinv.shape()[1], V.data(), ldc, 0.0,
+           C.data(), ldc);
+      gemm(k, k, m, 1.0, U.data(), ldu, C.data(), ldc, 1.0, M.data(), ld);
+    }
+
+    // Sorted positions of the old and the pending rows (t_i) and columns (t_f).
+    merge_positions(t_i, pend_i, row_pos, pend_row);
+    merge_positions(t_f, pend_f, col_pos, pend_col);
+
+    // Spread the old block out from the bottom-right, as in accept, then fill
+    // in -U Sinv, -W and Sinv.
+    for (int r = k - 1; r >= 0; r--) {
+      for (int s = k - 1; s >= 0; s--) {
+        M(row_pos[r], col_pos[s]) = M(r, s);
+      }
+    }
+    for (int r = 0; r < k; r++) {
+      for (int b = 0; b < m; b++) {
+        double x = 0.0;
+        for (int a = 0; a < m; a++) {
+          x += U(r, a) * Sinv(a, b);
+        }
+        M(row_pos[r], pend_col[b]) = -x;
+      }
+    }
+    for (int a = 0; a < m; a++) {
+      for (int s = 0; s < k; s++) {
+        M(pend_row[a], col_pos[s]) = -C(a, s);
+      }
+      for (int b = 0; b < m; b++) {
+        M(pend_row[a], pend_col[b]) = Sinv(a, b);
+      }
+    }
+    for (int r = k - 1; r >= 0; r--) {
+      t_i(row_pos[r]) = t_i(r);
+      t_f(col_pos[r]) = t_f(r);
+    }
+    for (int a = 0; a < m; a++) {
+      t_i(pend_row[a]) = pend_i(a);
+      t_f(pend_col[a]) = pend_f(a);
+    }
+    k = n;
+    n_pending = 0;
+    check_drift(m);
+  }
+
+private:
+  AlignedVector<double> b;
+  AlignedVector<double> c;
+  AlignedVector<double> Mb;
+  AlignedVector<double> cM;
+  double schur;
+  int pi;
+  int pf;
+  int cap;
+  int n_updates;
+  LogValue flip_det;
+
+  // Scratch for the O(k^3) inversions, the same size as M, and the LAPACK
+  // pivots and workspace, so that no step allocates.
+  static constexpr int lwork_per_row = 64;
+  AlignedMatrix<double> full;
+  std::vector<int> ipiv;
+  AlignedVector<double> work;
+
+  // Buffered insertions: their times, U = M B (k x m), the rows C of mat
+  // (m x k), the inverse Schur complement Sinv (m x m) and scratch.
+  int n_pending;
+  nda::vector<double> pend_i;
+  nda::vector<double> pend_f;
+  AlignedMatrix<double> U;
+  AlignedMatrix<double> C;
+  AlignedMatrix<double> V;
+  nda::matrix<double> Sinv;
+  nda::vector<double> p;
+  nda::vector<double> q;
+  nda::vector<double> Sp;
+  nda::vector<double> qS;
+  std::vector<int> row_pos;
+  std::vector<int> col_pos;
+  std::vector<int> pend_row;
+  std::vector<int> pend_col;
+
+  // Row-major C = alpha A B + beta C with the column-major BLAS, i.e.
+  // C^T = B^T A^T.
+  static void gemm(int m, int n, int l, double alpha, const double *A, int lda,
+                   const double *B, int ldb, double beta, double *C, int ldc) {
+    nda::blas::f77::gemm('N', 'N', n, m, l, alpha, B, ldb, A, lda, beta, C,
+                         ldc);
+  }
+
+  void buffer(InsertMove &move) {
+    int m = n_pending;
+    if (pend_i.size() != delay) {
+      pend_i = nda::zeros<double>(delay);
+      pend_f = nda::zeros<double>(delay);
+      Sinv = nda::zeros<double>(delay, delay);
+      p = nda::zeros<double>(delay);
+      q = nda::zeros<double>(delay);
+      Sp = nda::zeros<double>(delay);
+      qS = nda::zeros<double>(delay);
+    }
+    for (int i = 0; i < k; i++) {
+      U(i, m) = Mb(i);
+      C(m, i) = c(i);
+    }
+    // Border Sinv with the new row and column of the Schur complement, whose
+    // own Schur complement is the ratio.
+    double S = 1.0 / schur;
+    for (int b = 0; b < m; b++) {
+      double x = 0.0;
+      for (int a = 0; a < m; a++) {
+        x += q(a) * Sinv(a, b);
+      }
+      qS(b) = x;
+    }
+    for (int a = 0; a < m; a++) {
+      for (int b = 0; b < m; b++) {
+        Sinv(a, b) += S * Sp(a) * qS(b);
+      }
+      Sinv(a, m) = S * Sp(a);
+      Sinv(m, a) = S * qS(a);
+    }
+    Sinv(m, m) = S;
+    pend_i(m) = move.t_i;
+    pend_f(m) = move.t_f;
+    n_pending++;
+    det *= ((pi + pf) % 2 == 0) ? schur : -schur;
+  }
+
+  // Element (r, s) of the inverse including the pending insertions, at the
+  // sorted positions r of t_i and s of t_f.
+  double pending_inverse(int r, int s) {
+    merge_positions(t_i, pend_i, row_pos, pend_row);
+    merge_positions(t_f, pend_f, col_pos, pend_col);
+    int m = n_pending;
+    int i = std::find(row_pos.begin(), row_pos.end(), r) - row_pos.begin();
+    int j = std::find(col_pos.begin(), col_pos.end(), s) - col_pos.begin();
+    int a = std::find(pend_row.begin(), pend_row.end(), r) - pend_row.begin();
+    int b = std::find(pend_col.begin(), pend_col.end(), s) - pend_col.begin();
+    if (i < k) {
+      // (U Sinv)(i, :) into q.
+      for (int b2 = 0; b2 < m; b2++) {
+        double x = 0.0;
+        for (int a2 = 0; a2 < m; a2++) {
+          x += U(i, a2) * Sinv(a2, b2);
+        }
+        q(b2) = x;
+      }
+      if (b < m) {
+        return -q(b);
+      }
+    }
+    if (j < k) {
+      // (C M)(:, j) into p.
+      for (int a2 = 0; a2 < m; a2++) {
+        double x = 0.0;
+        for (int l = 0; l < k; l++) {
+          x += C(a2, l) * M(l, j);
+        }
+        p(a2) = x;
+      }
+    }
+    double x = 0.0;
+    if (i < k) {
+      x = M(i, j);
+      for (int b2 = 0; b2 < m; b2++) {
+        x += q(b2) * p(b2);
+      }
+      return x;
+    }
+    if (j < k) {
+      for (int b2 = 0; b2 < m; b2++) {
+        x -= Sinv(a, b2) * p(b2);
+      }
+      return x;
+    }
+    return Sinv(a, b);
+  }
+
+  // Sorted positions in the merged sequence of the k old times t and the
+  // n_pending times pend.
+  void merge_positions(const AlignedVector<double> &t,
+                       const nda::vector<double> &pend, std::vector<int> &pos,
+                       std::vector<int> &pend_pos) const {
+    pos.resize(k);
+    pend_pos.resize(n_pending);
+    for (int a = 0; a < n_pending; a++) {
+      pend_pos[a] = position(t, pend(a));
+      for (int b = 0; b < n_pending; b++) {
+        pend_pos[a] += pend(b) < pend(a);
+      }
+    }
+    for (int r = 0; r < k; r++) {
+      pos[r] = r;
+      for (int a = 0; a < n_pending; a++) {
+        pos[r] += pend(a) < t(r);
+      }
+    }
+  }
+
+  // Moves row from of M (and t_i) to position to, shifting the rows between.
+  void rotate_row(int from, int to) {
+    int step = to > from ? 1 : -1;
+    for (int r = from; r != to; r += step) {
+      std::swap(t_i(r), t_i(r + step));
+      for (int s = 0; s < k; s++) {
+        std::swap(M(r, s), M(r + step, s));
+      }
+    }
+  }
+
+  void rotate_column(int from, int to) {
+    int step = to > from ? 1 : -1;
+    for (int s = from; s != to; s += step) {
+      std::swap(t_f(s), t_f(s + step));
+      for (int r = 0; r < k; r++) {
+        std::swap(M(r, s), M(r, s + step));
+      }
+    }
+  }
+
+  // out = x M over the first k rows, accumulated a row of M at a time.
+  void row_times_M(const double *x, double *out) {
+    std::fill(out, out + k, 0.0);
+    for (int i = 0; i < k; i++) {
+      const double *Mi = &M(i, 0);
+      double xi = x[i];
+#pragma omp simd
+      for (int j = 0; j < k; j++) {
+        out[j] += xi * Mi[j];
+      }
+    }
+  }
+
+  int position(const AlignedVector<double> &t, double value) const {
+    return std::distance(t.begin(),
+                         std::lower_bound(t.begin(), t.begin() + k, value));
+  }
+
+  void reserve(int n) {
+    if (n <= cap) {
+      return;
+    }
+    int new_cap = AlignedMatrix<double>::padded(std::max(n, 2 * cap));
+    AlignedMatrix<double> new_M(new_cap, new_cap);
+    AlignedVector<double> new_t_i(new_cap);
+    AlignedVector<double> new_t_f(new_cap);
+    for (int i = 0; i < k; i++) {
+      new_t_i(i) = t_i(i);
+      new_t_f(i) = t_f(i);
+      std::copy_n(&M(i, 0), k, &new_M(i, 0));
+    }
+    M = std::move(new_M);
+    t_i = std::move(new_t_i);
+    t_f = std::move(new_t_f);
+    b = AlignedVector<double>(new_cap);
+    c = AlignedVector<double>(new_cap);
+    Mb = AlignedVector<double>(new_cap);
+    cM = AlignedVector<double>(new_cap);
+    int size = std::max(delay, 1);
+    AlignedMatrix<double> new_U(new_cap, size);
+    AlignedMatrix<double> new_C(size, new_cap);
+    for (int a = 0; a < n_pending; a++) {
+      for (int i = 0; i < k; i++) {
+        new_U(i, a) = U(i, a);
+        new_C(a, i) = C(a, i);
+      }
+    }
+    U = std::move(new_U);
+    C = std::move(new_C);
+    V = AlignedMatrix<double>(size, new_cap);
+    full = AlignedMatrix<double>(new_cap, new_cap);
+    ipiv.assign(new_cap, 0);
+    work = AlignedVector<double>(lwork_per_row * new_cap);
+    cap = new_cap;
+  }
+
+  // Full O(k^3) evaluation of the inverse and determinant; returns the largest
+  // deviation from the incrementally updated inverse relative to max |M|. If
+  // the matrix is singular, M and det are left as they were and the deviation
+  // is infinite.
+  double recompute() {
+    if (k == 0) {
+      det = LogValue();
+      return 0.0;
+    }
+    for (int j = 0; j < k; j++) {
+      Delta.row(t_f(j), t_i.data(), k, &full(j, 0));
+    }
+    LogValue value = invert_full();
+    if (value.sign == 0) {
+      return std::numeric_limits<double>::infinity();
+    }
+    det = value;
+    double drift = 0.0;
+    double norm = 0.0;
+    for (int i = 0; i < k; i++) {
+      for (int j = 0; j < k; j++) {
+        drift = std::max(drift, std::abs(full(i, j) - M(i, j)));
+        norm = std::max(norm, std::abs(full(i, j)));
+      }
+    }
+    std::swap(M, full);
+    return drift / norm;
+  }
+
+  // LU factorization of the leading n x n block of full in place with
+  // LAPACK; returns its determinant.
+  LogValue factorize_full(int n) {
+    int info = 0;
+    nda::lapack::f77::getrf(n, n, full.data(), full.stride(), ipiv.data(),
+                            info);
+    if (info != 0) {
+      return LogValue(-std::numeric_limits<double>::infinity(), 0);
+    }
+    LogValue value;
+    for (int i = 0; i < n; i++) {
+      value *= full(i, i);
+      if (ipiv[i] != i + 1) {
+        value.sign = -value.sign;
+      }
+    }
+    return value;
+  }
+
+  // Inverts the leading k x k block of full in place and returns its
+  // determinant, with sign 0 if the block is singular. LAPACK sees the
+  // transpose of the row-major block, whose inverse read row-major is the
+  // inverse of the block.
+  LogValue invert_full() {
+    LogValue value = factorize_full(k);
+    if (value.sign == 0) {
+      return value;
+    }
+    int info = 0;
+    nda::lapack::f77::getri(k, full.data(), full.stride(), ipiv.data(),
+                            work.data(), work.size(), info);
+    if (info != 0) {
+      return LogValue(-std::numeric_limits<double>::infinity(), 0);
+    }
+    return value;
+  }
+
+  void check_drift(int n = 1) {
+    n_updates += n;
+    if (recompute_period <= 0 ||
+        n_updates / recompute_period == (n_updates - n) / recompute_period) {
+      return;
+    }
+    double drift = recompute();
+    if (drift == std::numeric_limits<double>::infinity()) {
+      std::cerr << "FastUpdate: matrix singular at order " << k
+                << ", kept the updated inverse" << std::endl;
+      return;
+    }
+    max_drift = std::max(max_drift, drift);
+    if (drift > tolerance) {
+      std::cerr << "FastUpdate: inverse drifted by " << drift << " (relative) at order "
+                << k << ", recomputed" << std::endl;
+    }
+  }
+};
+
+} // namespace tinycthyb
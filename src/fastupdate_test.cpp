@@ -0,0 +1,154 @@
+#include "fastupdate.hpp"
+#include "fixtures.hpp"
+#include "hybridization.hpp"
+#include "rng.hpp"
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+using namespace tinycthyb;
+
+// Whether d has the determinant of a fresh rebuild from c.
+bool same_determinant(FastUpdate &d, Configuration &c,
+                      double tolerance = 1e-8) {
+  FastUpdate fresh(d.Delta);
+  fresh.rebuild(c);
+  double diff = std::abs(d.value().log - fresh.value().log);
+  return d.value().sign == fresh.value().sign && diff < tolerance;
+}
+
+// Swaps two flavors of one hybridization whose inverses have different
+// capacities, then inserts one operator pair into each without reaching the
+// capacity, recomputing after every update so that the full inversion runs on
+// the swapped scratch, and compares the determinants with a fresh rebuild.
+int test_swap(Hybridization &Delta, Rng &rng) {
+  double beta = Delta.beta;
+  auto small = random_configuration(3, beta, rng);
+  auto large = random_configuration(30, beta, rng);
+
+  FastUpdate a(Delta, 1), b(Delta, 1);
+  a.rebuild(small);
+  b.rebuild(large);
+  a.swap(b);
+
+  int failures = 0;
+  auto check = [&](FastUpdate &d, Configuration &c, const char *name) {
+    auto move = InsertMove(beta * rng.uniform(), beta * rng.uniform(), beta);
+    d.ratio(move);
+    d.accept(move);
+    c.insert(move);
+    c.commit();
+    if (!same_determinant(d, c)) {
+      std::cerr << "swap: wrong determinant of the " << name
+                << " configuration" << std::endl;
+      failures++;
+    }
+  };
+  check(a, large, "large");
+  check(b, small, "small");
+
+  FastUpdate e(Delta, 1, 1e-8, a.delay + 1);
+  try {
+    a.swap(e);
+    std::cerr << "swap: no error for a different delay" << std::endl;
+    failures++;
+  } catch (const std::invalid_argument &) {
+  }
+  return failures;
+}
+
+// Two equal creation times make the matrix singular: zero weight.
+int test_singular(Hybridization &Delta) {
+  auto singular = Configuration(nda::vector<double>{1.0, 1.0},
+                                nda::vector<double>{2.0, 3.0});
+  FastUpdate s(Delta);
+  s.rebuild(singular);
+  if (s.value().sign != 0) {
+    std::cerr << "singular: determinant " << s.value().value() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Random insertions, removals and shifts with insertions buffered from order
+// 4 on and no recomputes, so that only the rank-k updates keep the inverse.
+// The determinant, pending insertions included, is compared with a rebuild
+// every 10 steps and the flushed inverse every 100, after which d restarts
+// from the rebuild. Moves with a ratio below 1e-2 are rejected, as nearly
+// singular matrices would lose more digits than the updates themselves.
+int test_delayed(Hybridization &Delta, Rng &rng) {
+  double beta = Delta.beta;
+  auto c = random_configuration(10, beta, rng);
+  FastUpdate d(Delta, 0, 1e-8, 8, 4);
+  d.rebuild(c);
+
+  int failures = 0;
+  long buffered = 0;
+  for (int step = 1; step <= 20000 && failures < 10; step++) {
+    int k = c.length();
+    double u = rng.uniform();
+    if ((k < 10 || u < 0.45) && k < 60) {
+      auto move = InsertMove(beta * rng.uniform(), beta * rng.uniform(), beta);
+      if (std::abs(d.ratio(move)) > 1e-2) {
+        d.accept(move);
+        c.insert(move);
+        c.commit();
+      }
+    } else if (u < 0.8) {
+      auto move = RemovalMove(rng.randint(0, k - 1), rng.randint(0, k - 1),
+                              beta);
+      if (std::abs(d.ratio(move)) > 1e-2) {
+        d.accept(move);
+        c.remove(move);
+        c.commit();
+      }
+    } else {
+      auto move = ShiftMove(rng.randint(0, k - 1), rng.uniform() < 0.5,
+                            beta * rng.uniform(), beta);
+      if (std::abs(d.ratio(move)) > 1e-2) {
+        d.accept(move);
+        c.shift(move);
+        c.commit();
+      }
+    }
+    buffered += d.order() - d.k;
+
+    if (step % 10 == 0 && !same_determinant(d, c, 1e-6)) {
+      std::cerr << "delayed: wrong determinant at step " << step << std::endl;
+      failures++;
+    }
+    if (step % 100 == 0) {
+      d.flush();
+      FastUpdate fresh(Delta);
+      fresh.rebuild(c);
+      double diff = 0.0;
+      double norm = 0.0;
+      for (int i = 0; i < d.k; i++) {
+        for (int j = 0; j < d.k; j++) {
+          diff = std::max(diff, std::abs(d.M(i, j) - fresh.M(i, j)));
+          norm = std::max(norm, std::abs(fresh.M(i, j)));
+        }
+      }
+      if (!(diff <= 1e-6 * norm)) {
+        std::cerr << "delayed: inverse off by " << diff / norm
+                  << " (relative) at step " << step << std::endl;
+        failures++;
+      }
+      d.rebuild(c);
+    }
+  }
+  if (buffered == 0) {
+    std::cerr << "delayed: no insertion was buffered" << std::endl;
+    failures++;
+  }
+  return failures;
+}
+
+int main() {
+  auto Delta = semi_circular_hybridization(200, 4001);
+  Rng rng(1234);
+  int failures =
+      test_swap(Delta, rng) + test_singular(Delta) + test_delayed(Delta, rng);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <algorithm>
+#include <nda/nda.hpp>
+#include <vector>
+
+#include "configuration.hpp"
+#include "rng.hpp"
+
+namespace tinycthyb {
+
+// Shared by the benchmark and the tests.
+
+// Proper configuration of the given order with uniformly random times.
+Configuration random_configuration(int order, double beta, Rng &rng) {
+  std::vector<double> times(2 * order);
+  for (auto &t : times) {
+    t = beta * rng.uniform();
+  }
+  std::sort(times.begin(), times.end());
+  auto t_i = nda::zeros<double>(order);
+  auto t_f = nda::zeros<double>(order);
+  for (int n = 0; n < order; n++) {
+    t_i(n) = times[2 * n];
+    t_f(n) = times[2 * n + 1];
+  }
+  return Configuration(t_i, t_f);
+}
+
+} // namespace tinycthyb
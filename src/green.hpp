@@ -1,15 +1,21 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
+#include <complex>
+#include <exception>
 #include <fstream>
+#include <iostream>
 #include <nda/nda.hpp>
+#include <optional>
 #include <string>
+#include <vector>
 
 class GreensFunction {
 
 public:
   double beta;
-  const nda::vector<double> data;
+  nda::vector<double> data;
   double sign;
   int N;
 
@@ -34,6 +40,12 @@ public:
     return GreensFunction(beta, new_data, sign);
   }
 
+  GreensFunction &operator+=(const GreensFunction &other) {
+    data += other.data;
+    sign += other.sign;
+    return *this;
+  }
+
   void accumulate(double time, double value) {
     if (time < 0.0) {
       value *= -1;
@@ -43,6 +55,61 @@ public:
     data(idx) += value;
   }
 
+  // Adds M(i, j) at the times t_f[j] - t_i[i] for i, j < n, with the rows of
+  // M ld apart and row i scaled by row_weight[i] if given. The times are
+  // scaled to bin units once per operator; each row then gets its bins and
+  // signs in a vectorized pass and is added to data in a scalar pass, so
+  // lanes hitting the same bin never conflict.
+  void accumulate(const double *t_i, const double *t_f, int n, const double *M,
+                  long ld, const double *row_weight = nullptr) {
+    if (n == 0) {
+      return;
+    }
+    reserve(n);
+    double *u_f = scratch.data();
+    double *v = u_f + cap;
+    int *idx = bins.data();
+    double *hist = data.data();
+    double scale = N / beta;
+#pragma omp simd
+    for (int j = 0; j < n; j++) {
+      u_f[j] = scale * t_f[j];
+    }
+    for (int i = 0; i < n; i++) {
+      const double *Mi = M + i * ld;
+      double u_i = scale * t_i[i];
+      double w = row_weight == nullptr ? 1.0 : row_weight[i];
+      if (w == 0.0) {
+        continue;
+      }
+#pragma omp simd
+      for (int j = 0; j < n; j++) {
+        double u = u_f[j] - u_i;
+        double s = u < 0.0 ? -w : w;
+        u += u < 0.0 ? N : 0.0;
+        idx[j] = std::min(static_cast<int>(u), N - 1);
+        v[j] = s * Mi[j];
+      }
+      for (int j = 0; j < n; j++) {
+        hist[idx[j]] += v[j];
+      }
+    }
+  }
+
+  // G(tau) at the given times, normalized like write_data: linear between
+  // the bin centers and extrapolated from the outermost two bins.
+  nda::vector<double> evaluate(const nda::vector<double> &times) const {
+    double dt = beta / N;
+    auto out = nda::zeros<double>(times.size());
+    for (int i = 0; i < times.size(); i++) {
+      double u = times(i) / dt - 0.5;
+      int idx = std::clamp(static_cast<int>(std::floor(u)), 0, N - 2);
+      double w = u - idx;
+      out(i) = ((1.0 - w) * data(idx) + w * data(idx + 1)) / (-sign * beta * dt);
+    }
+    return out;
+  }
+
   int write_data(std::string filename) const {
     std::ofstream outputFile(filename);
     if (!outputFile.is_open()) {
@@ -58,25 +125,286 @@ public:
     outputFile.close();
     return 0;
   }
+
+private:
+  nda::vector<double> scratch;
+  std::vector<int> bins;
+  int cap = 0;
+
+  void reserve(int n) {
+    if (n > cap) {
+      cap = std::max(n, 2 * cap);
+      scratch = nda::zeros<double>(2 * cap);
+      bins.assign(cap, 0);
+    }
+  }
+};
+
+// G_l = -sqrt(2l + 1) / beta <sum_ij M_ji P_l(x)>, x = 2 tau / beta - 1, measured
+// directly from the inverse hybridization matrix one row at a time.
+class LegendreGreensFunction {
+
+public:
+  double beta;
+  nda::vector<double> data;
+  double sign;
+  int N;
+
+  LegendreGreensFunction(double beta, int N)
+      : beta(beta), data(nda::zeros<double>(N)), sign(0.0), N(N) {}
+
+  int length() { return N; }
+
+  LegendreGreensFunction &operator+=(const LegendreGreensFunction &other) {
+    data += other.data;
+    sign += other.sign;
+    return *this;
+  }
+
+  // Adds values[j] at the times t_f[j] - t_i for j < n. The Legendre
+  // recurrence runs over l with the inner loop over j.
+  void accumulate(const double *t_f, int n, double t_i, const double *values) {
+    if (N == 0 || n == 0) {
+      return;
+    }
+    reserve(n);
+    double *x = scratch.data();
+    double *v = x + cap;
+    double *p0 = v + cap;
+    double *p1 = p0 + cap;
+    double sum0 = 0.0;
+    double sum1 = 0.0;
+    for (int j = 0; j < n; j++) {
+      double tau = t_f[j] - t_i;
+      double s = tau < 0.0 ? -1.0 : 1.0;
+      tau += tau < 0.0 ? beta : 0.0;
+      x[j] = 2.0 * tau / beta - 1.0;
+      v[j] = s * values[j];
+      p0[j] = 1.0;
+      p1[j] = x[j];
+      sum0 += v[j];
+      sum1 += v[j] * x[j];
+    }
+    data(0) += sum0;
+    if (N > 1) {
+      data(1) += sum1;
+    }
+    for (int l = 1; l + 1 < N; l++) {
+      double a = (2.0 * l + 1.0) / (l + 1.0);
+      double b = l / (l + 1.0);
+      double sum = 0.0;
+#pragma omp simd reduction(+ : sum)
+      for (int j = 0; j < n; j++) {
+        double p2 = a * x[j] * p1[j] - b * p0[j];
+        p0[j] = p1[j];
+        p1[j] = p2;
+        sum += v[j] * p2;
+      }
+      data(l + 1) += sum;
+    }
+  }
+
+  nda::vector<double> coefficients() const {
+    auto out = nda::zeros<double>(N);
+    for (int l = 0; l < N; l++) {
+      out(l) = std::sqrt(2.0 * l + 1.0) * data(l) / (-sign * beta);
+    }
+    return out;
+  }
+
+  // G(tau) = sum_l sqrt(2l + 1) / beta P_l(x) G_l at the given times.
+  nda::vector<double> evaluate(const nda::vector<double> &times) const {
+    auto G_l = coefficients();
+    auto out = nda::zeros<double>(times.size());
+    for (int i = 0; i < times.size(); i++) {
+      double x = 2.0 * times(i) / beta - 1.0;
+      double p0 = 1.0;
+      double p1 = x;
+      double sum = N > 0 ? G_l(0) : 0.0;
+      if (N > 1) {
+        sum += std::sqrt(3.0) * G_l(1) * x;
+      }
+      for (int l = 1; l + 1 < N; l++) {
+        double p2 = ((2.0 * l + 1.0) * x * p1 - l * p0) / (l + 1.0);
+        p0 = p1;
+        p1 = p2;
+        sum += std::sqrt(2.0 * l + 3.0) * G_l(l + 1) * p2;
+      }
+      out(i) = sum / beta;
+    }
+    return out;
+  }
+
+  int write_data(std::string filename) const {
+    std::ofstream outputFile(filename);
+    if (!outputFile.is_open()) {
+      std::cerr << "Failed to open file!" << std::endl;
+      return 1;
+    }
+
+    for (auto val : coefficients()) {
+      outputFile << val << " ";
+    }
+    outputFile.close();
+    return 0;
+  }
+
+private:
+  nda::vector<double> scratch;
+  int cap = 0;
+
+  void reserve(int n) {
+    if (n > cap) {
+      cap = std::max(n, 2 * cap);
+      scratch = nda::zeros<double>(4 * cap);
+    }
+  }
+};
+
+// G(iw_n) = -1 / beta <sum_ij M_ji exp(i w_n tau)> for w_n = (2n + 1) pi / beta,
+// with the phase advanced by exp(2 pi i tau / beta) from one frequency to the
+// next instead of calling exp for every frequency.
+class MatsubaraGreensFunction {
+
+public:
+  double beta;
+  nda::vector<std::complex<double>> data;
+  double sign;
+  int N;
+
+  MatsubaraGreensFunction(double beta, int N)
+      : beta(beta), data(nda::zeros<std::complex<double>>(N)), sign(0.0),
+        N(N) {}
+
+  int length() { return N; }
+
+  MatsubaraGreensFunction &operator+=(const MatsubaraGreensFunction &other) {
+    data += other.data;
+    sign += other.sign;
+    return *this;
+  }
+
+  // Adds values[j] at the times t_f[j] - t_i for j < n.
+  void accumulate(const double *t_f, int n, double t_i, const double *values) {
+    if (N == 0 || n == 0) {
+      return;
+    }
+    reserve(n);
+    double *re = scratch.data();
+    double *im = re + cap;
+    double *step_re = im + cap;
+    double *step_im = step_re + cap;
+    double *v = step_im + cap;
+    for (int j = 0; j < n; j++) {
+      double tau = t_f[j] - t_i;
+      double s = tau < 0.0 ? -1.0 : 1.0;
+      tau += tau < 0.0 ? beta : 0.0;
+      double phi = M_PI * tau / beta;
+      re[j] = std::cos(phi);
+      im[j] = std::sin(phi);
+      step_re[j] = re[j] * re[j] - im[j] * im[j];
+      step_im[j] = 2.0 * re[j] * im[j];
+      v[j] = s * values[j];
+    }
+    for (int w = 0; w < N; w++) {
+      double sum_re = 0.0;
+      double sum_im = 0.0;
+#pragma omp simd reduction(+ : sum_re, sum_im)
+      for (int j = 0; j < n; j++) {
+        sum_re += v[j] * re[j];
+        sum_im += v[j] * im[j];
+        double r = re[j] * step_re[j] - im[j] * step_im[j];
+        im[j] = re[j] * step_im[j] + im[j] * step_re[j];
+        re[j] = r;
+      }
+      data(w) += std::complex<double>(sum_re, sum_im);
+    }
+  }
+
+  int write_data(std::string filename) const {
+    std::ofstream outputFile(filename);
+    if (!outputFile.is_open()) {
+      std::cerr << "Failed to open file!" << std::endl;
+      return 1;
+    }
+
+    for (int w = 0; w < N; w++) {
+      auto val = data(w) / (-sign * beta);
+      outputFile << (2 * w + 1) * M_PI / beta << " " << val.real() << " "
+                 << val.imag() << std::endl;
+    }
+    outputFile.close();
+    return 0;
+  }
+
+private:
+  nda::vector<double> scratch;
+  int cap = 0;
+
+  void reserve(int n) {
+    if (n > cap) {
+      cap = std::max(n, 2 * cap);
+      scratch = nda::zeros<double>(5 * cap);
+    }
+  }
 };
 
-GreensFunction read_semi_circular_g_tau(void) {
+// Sigma(iw_n) = F(iw_n) / G(iw_n) from the improved estimator F = Sigma G,
+// written like MatsubaraGreensFunction::write_data.
+int write_self_energy(std::string filename, const MatsubaraGreensFunction &giw,
+                      const MatsubaraGreensFunction &fiw) {
+  std::ofstream outputFile(filename);
+  if (!outputFile.is_open()) {
+    std::cerr << "Failed to open file!" << std::endl;
+    return 1;
+  }
+
+  for (int w = 0; w < giw.N; w++) {
+    auto val = fiw.data(w) / giw.data(w);
+    outputFile << (2 * w + 1) * M_PI / giw.beta << " " << val.real() << " "
+               << val.imag() << std::endl;
+  }
+  outputFile.close();
+  return 0;
+}
+
+// Reads G(tau) on the grid of N points, written one value per line. A file
+// that is missing, unparsable or has another number of lines is rejected.
+std::optional<GreensFunction> read_g_tau(std::string filename, double beta,
+                                         int N) {
 
-  double beta = 20;
-  int nt = 200;
-  auto data = nda::zeros<double>(nt);
+  std::vector<double> values;
   double sign = 0.0;
 
-  std::fstream inputFile("gref.txt");
+  std::fstream inputFile(filename);
+  if (!inputFile.is_open()) {
+    std::cerr << "Failed to open file!" << std::endl;
+    return std::nullopt;
+  }
 
   std::string line;
-  int idx = 0;
-  while (std::getline(inputFile, line)) {
-    double value = std::stod(line);
-    data(idx) = value;
-    idx += 1;
+  try {
+    while (std::getline(inputFile, line)) {
+      values.push_back(std::stod(line));
+    }
+  } catch (std::exception &) {
+    std::cerr << "Invalid G(tau) file!" << std::endl;
+    return std::nullopt;
   }
   inputFile.close();
+  if (static_cast<int>(values.size()) != N) {
+    std::cerr << "Expected " << N << " values of G(tau) in " << filename
+              << ", found " << values.size() << std::endl;
+    return std::nullopt;
+  }
 
+  auto data = nda::zeros<double>(N);
+  for (int idx = 0; idx < N; idx++) {
+    data(idx) = values[idx];
+  }
   return GreensFunction(beta, data, sign);
 }
+
+std::optional<GreensFunction> read_semi_circular_g_tau(int N = 200) {
+  return read_g_tau("gref.txt", 20, N);
+}
@@ -1,44 +1,138 @@
 #pragma once
 
 #include <algorithm>
+#include <cmath>
 #include <nda/nda.hpp>
 
 namespace tinycthyb {
 
+// Linear interpolation of Delta(tau) on a time grid. When the grid is uniform
+// the bin is found arithmetically instead of by bisection.
 class Hybridization {
 public:
   nda::vector<double> times;
   nda::vector<double> values;
   double beta;
+  bool uniform;
 
   Hybridization(nda::vector<double> times, nda::vector<double> values,
                 double beta)
-      : times(times), values(values), beta(beta) {}
+      : times(times), values(values), beta(beta) {
+    int n = times.size();
+    slopes = nda::zeros<double>(n);
+    for (int i = 0; i + 1 < n; i++) {
+      slopes(i) = (values(i + 1) - values(i)) / (times(i + 1) - times(i));
+    }
+    dt = (times(n - 1) - times(0)) / (n - 1);
+    inv_dt = 1.0 / dt;
+    uniform = true;
+    for (int i = 0; i < n; i++) {
+      if (std::abs(times(i) - (times(0) + i * dt)) > 1e-10 * beta) {
+        uniform = false;
+      }
+    }
+  }
 
-  double operator()(double t) {
+  double operator()(double t) const {
     double s = 1.0;
     if (t < 0.0) {
       s = -1.0;
       t += beta;
     }
 
-    auto it = std::lower_bound(times.begin(), times.end(), t); // iterator to element
-    int idx = std::distance(times.begin(), it);
-    idx = idx == 0 ? 1 : idx;
-    double ti = times(idx - 1);
-    double tf = times(idx);
-    double vi = values(idx - 1);
-    double vf = values(idx);
-    return s * (vi + (t - ti) * (vf - vi) / (tf - ti));
+    int idx;
+    if (uniform) {
+      idx = bin(t);
+    } else {
+      auto it = std::lower_bound(times.begin(), times.end(), t); // iterator to element
+      idx = std::distance(times.begin(), it);
+      idx = std::clamp(idx - 1, 0, static_cast<int>(times.size()) - 2);
+    }
+    return s * (values(idx) + (t - times(idx)) * slopes(idx));
   }
 
-  nda::vector<double> operator()(nda::vector<double> time) {
+  nda::vector<double> operator()(nda::vector<double> time) const {
     auto out = nda::zeros<double>(time.size());
     for (int i = 0; i < time.size(); i++) {
       out(i) = (*this)(time(i));
     }
     return out;
   }
+
+  // out[i] = Delta(t_f - t_i[i]) for i < n, i.e. one row of the
+  // hybridization matrix.
+  void row(double t_f, const double *t_i, int n, double *out) const {
+    if (!uniform) {
+      for (int i = 0; i < n; i++) {
+        out[i] = (*this)(t_f - t_i[i]);
+      }
+      return;
+    }
+#pragma omp simd
+    for (int i = 0; i < n; i++) {
+      out[i] = interpolate(t_f - t_i[i]);
+    }
+  }
+
+  // out[j] = Delta(t_f[j] - t_i) for j < n, i.e. one column of the
+  // hybridization matrix.
+  void column(const double *t_f, int n, double t_i, double *out) const {
+    if (!uniform) {
+      for (int j = 0; j < n; j++) {
+        out[j] = (*this)(t_f[j] - t_i);
+      }
+      return;
+    }
+#pragma omp simd
+    for (int j = 0; j < n; j++) {
+      out[j] = interpolate(t_f[j] - t_i);
+    }
+  }
+
+private:
+  nda::vector<double> slopes;
+  double dt;
+  double inv_dt;
+
+  int bin(double t) const {
+    int idx = static_cast<int>((t - times(0)) * inv_dt);
+    return std::clamp(idx, 0, static_cast<int>(times.size()) - 2);
+  }
+
+  // Branch-free uniform grid evaluation for the batched loops.
+  double interpolate(double t) const {
+    double s = t < 0.0 ? -1.0 : 1.0;
+    t += t < 0.0 ? beta : 0.0;
+    int idx = bin(t);
+    double t0 = times(0) + idx * dt;
+    return s * (values(idx) + (t - t0) * slopes(idx));
+  }
 };
 
+// Hybridization of a semicircular bath with half bandwidth 1 and t = 1/2,
+// discretized on n_levels energies, so that any beta can be used without a
+// reference file.
+Hybridization semi_circular_hybridization(double beta, int nt,
+                                          int n_levels = 200) {
+  auto times = nda::zeros<double>(nt);
+  auto values = nda::zeros<double>(nt);
+  for (int i = 0; i < nt; i++) {
+    times(i) = beta * (double)i / (nt - 1);
+  }
+  double norm = 0.0;
+  for (int n = 0; n < n_levels; n++) {
+    double eps = -1.0 + 2.0 * (n + 0.5) / n_levels;
+    norm += std::sqrt(1.0 - eps * eps);
+  }
+  for (int n = 0; n < n_levels; n++) {
+    double eps = -1.0 + 2.0 * (n + 0.5) / n_levels;
+    double w = std::sqrt(1.0 - eps * eps) / norm;
+    for (int i = 0; i < nt; i++) {
+      values(i) += 0.25 * w * std::exp(-eps * times(i)) /
+                   (1.0 + std::exp(-beta * eps));
+    }
+  }
+  return Hybridization(times, values, beta);
+}
+
 } // namespace tinycthyb
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <h5/h5.hpp>
+#include <iostream>
+#include <nda/h5.hpp>
+#include <nda/nda.hpp>
+#include <optional>
+#include <string>
+
+#include "checkpoint.hpp"
+#include "green.hpp"
+#include "hybridization.hpp"
+
+namespace tinycthyb {
+
+// Binary G(tau) and Delta(tau) files: a magic number, beta and N, then the
+// sign and N bins for G, or N times followed by N values for Delta. All in
+// native byte order, without any parsing on the way in.
+constexpr std::uint64_t g_tau_magic = 0x3155415447485443;     // "CTHGTAU1"
+constexpr std::uint64_t delta_tau_magic = 0x3155415444485443; // "CTHDTAU1"
+
+int write_binary(std::string filename, const GreensFunction &g) {
+  std::ofstream out(filename, std::ios::binary);
+  if (!out.is_open()) {
+    std::cerr << "Failed to open file!" << std::endl;
+    return 1;
+  }
+  write_value(out, g_tau_magic);
+  write_value(out, g.beta);
+  write_value(out, static_cast<long>(g.N));
+  write_value(out, g.sign);
+  out.write(reinterpret_cast<const char *>(g.data.data()),
+            g.N * sizeof(double));
+  return out ? 0 : 1;
+}
+
+int read_binary(std::string filename, GreensFunction &g) {
+  std::ifstream in(filename, std::ios::binary);
+  if (!in.is_open()) {
+    std::cerr << "Failed to open file!" << std::endl;
+    return 1;
+  }
+  std::uint64_t magic;
+  double beta, sign;
+  long N;
+  nda::vector<double> data;
+  if (!read_value(in, magic) || magic != g_tau_magic || !read_value(in, beta) ||
+      !read_value(in, N) || N < 0 || !read_value(in, sign)) {
+    std::cerr << "Invalid G(tau) file!" << std::endl;
+    return 1;
+  }
+  data = nda::zeros<double>(N);
+  in.read(reinterpret_cast<char *>(data.data()), N * sizeof(double));
+  if (!in) {
+    std::cerr << "Invalid G(tau) file!" << std::endl;
+    return 1;
+  }
+  g = GreensFunction(beta, data, sign);
+  return 0;
+}
+
+int write_binary(std::string filename, const Hybridization &Delta) {
+  std::ofstream out(filename, std::ios::binary);
+  if (!out.is_open()) {
+    std::cerr << "Failed to open file!" << std::endl;
+    return 1;
+  }
+  long n = Delta.times.size();
+  write_value(out, delta_tau_magic);
+  write_value(out, Delta.beta);
+  write_value(out, n);
+  out.write(reinterpret_cast<const char *>(Delta.times.data()),
+            n * sizeof(double));
+  out.write(reinterpret_cast<const char *>(Delta.values.data()),
+            n * sizeof(double));
+  return out ? 0 : 1;
+}
+
+// Reads a file written by write_binary(filename, Delta). The doubles go
+// straight into the arrays the Hybridization keeps, which computes its slopes
+// from them in the same O(N) pass.
+std::optional<Hybridization> read_hybridization(std::string filename) {
+  std::ifstream in(filename, std::ios::binary);
+  if (!in.is_open()) {
+    std::cerr << "Failed to open file!" << std::endl;
+    return std::nullopt;
+  }
+  std::uint64_t magic;
+  double beta;
+  long n;
+  if (!read_value(in, magic) || magic != delta_tau_magic ||
+      !read_value(in, beta) || !read_value(in, n) || n < 2) {
+    std::cerr << "Invalid Delta(tau) file!" << std::endl;
+    return std::nullopt;
+  }
+  nda::vector<double> times = nda::zeros<double>(n);
+  nda::vector<double> values = nda::zeros<double>(n);
+  in.read(reinterpret_cast<char *>(times.data()), n * sizeof(double));
+  in.read(reinterpret_cast<char *>(values.data()), n * sizeof(double));
+  if (!in) {
+    std::cerr << "Invalid Delta(tau) file!" << std::endl;
+    return std::nullopt;
+  }
+  return Hybridization(times, values, beta);
+}
+
+// HDF5 through the TRIQS h5 layer, one group per object with the metadata
+// stored next to the data.
+int write_h5(std::string filename, const GreensFunction &g,
+             std::string name = "G_tau") {
+  try {
+    h5::file file(filename, 'a');
+    auto group = h5::group(file).create_group(name);
+    h5::write(group, "beta", g.beta);
+    h5::write(group, "N", g.N);
+    h5::write(group, "sign", g.sign);
+    h5::write(group, "data", g.data);
+  } catch (std::exception &err) {
+    std::cerr << "Failed to write " << filename << ": " << err.what()
+              << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Rejects a group whose N does not match the size of its data.
+int read_h5(std::string filename, GreensFunction &g,
+            std::string name = "G_tau") {
+  try {
+    h5::file file(filename, 'r');
+    auto group = h5::group(file).open_group(name);
+    double beta, sign;
+    int N;
+    nda::vector<double> data;
+    h5::read(group, "beta", beta);
+    h5::read(group, "N", N);
+    h5::read(group, "sign", sign);
+    h5::read(group, "data", data);
+    if (N != data.size()) {
+      std::cerr << "Invalid G(tau) in " << filename << ": N " << N << " for "
+                << data.size() << " values" << std::endl;
+      return 1;
+    }
+    g = GreensFunction(beta, data, sign);
+  } catch (std::exception &err) {
+    std::cerr << "Failed to read " << filename << ": " << err.what()
+              << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+int write_h5(std::string filename, const Hybridization &Delta,
+             std::string name = "Delta_tau") {
+  try {
+    h5::file file(filename, 'a');
+    auto group = h5::group(file).create_group(name);
+    h5::write(group, "beta", Delta.beta);
+    h5::write(group, "times", Delta.times);
+    h5::write(group, "values", Delta.values);
+  } catch (std::exception &err) {
+    std::cerr << "Failed to write " << filename << ": " << err.what()
+              << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+std::optional<Hybridization> read_h5_hybridization(
+    std::string filename, std::string name = "Delta_tau") {
+  try {
+    h5::file file(filename, 'r');
+    auto group = h5::group(file).open_group(name);
+    double beta;
+    nda::vector<double> times, values;
+    h5::read(group, "beta", beta);
+    h5::read(group, "times", times);
+    h5::read(group, "values", values);
+    return Hybridization(times, values, beta);
+  } catch (std::exception &err) {
+    std::cerr << "Failed to read " << filename << ": " << err.what()
+              << std::endl;
+    return std::nullopt;
+  }
+}
+
+} // namespace tinycthyb
@@ -3,14 +3,21 @@
 //#include "antisegment.hpp"
 //#include "hybridization.hpp"
 #include "green.hpp"
+#include "io.hpp"
+#include "parallel.hpp"
 #include "solver.hpp"
 //#include "util.hpp"
+#include <random>
+#include <thread>
 //
 using namespace tinycthyb;
 
 #define DEBUG false
 
-int main(){
+int main(int argc, char *argv[]){
+
+    mpi::environment env(argc, argv);
+    mpi::communicator world;
 
     double beta = 20;
     double h = 0;
@@ -18,19 +25,21 @@ int main(){
     auto times = nda::zeros<double>(nt);
     for (int i=0; i < nt; i++){ times(i) = beta * (double)i/(nt-1); }
 
-    GreensFunction g_ref = read_semi_circular_g_tau();
-    Hybridization Delta = Hybridization(times, -0.25*g_ref.data, beta);
+    auto g_ref = read_semi_circular_g_tau(nt);
+    if (!g_ref) { return 1; }
+    Hybridization Delta = Hybridization(times, -0.25*g_ref->data, beta);
 
     auto e = Expansion(beta, h, Delta);
 
     
 //TODO: move to tests
 #if DEBUG
+    {
 
     for (auto i=0; i<100; i++) {
         auto ti = beta*nda::rand<>();
         auto tf = beta*nda::rand<>();
-        std::cout << e.Delta(tf-ti) << std::endl;
+        std::cout << e.Delta[0].get()(tf-ti) << std::endl;
     }
 
     auto c = Configuration(nda::vector<double>{1.0}, nda::vector<double>{3.0} );
@@ -143,17 +152,41 @@ int main(){
         remove_antisegment(ctmp, idx);
         for (auto s : antisegments(ctmp)) { s.print(); }
     }
+    }
 #endif
 
-    auto moves = std::vector<MoveFunc>{ 
-                                        NewSegmentInsertionMove,
-                                        NewAntiSegmentInsertionMove,
-                                        NewSegmentRemoveMove, 
-                                        NewAntiSegmentRemoveMove
-                                    };
-    auto c = Configuration(nda::vector<double>{}, nda::vector<double>{});
-    auto S = Solver(Delta, e, moves, nt) ;
-    S.solve(c);
-    S.g.write_data("gmeasure.txt");
+    auto moves = MoveSet<NewSegmentInsertionMove,
+                         NewAntiSegmentInsertionMove,
+                         NewSegmentRemoveMove,
+                         NewAntiSegmentRemoveMove,
+                         NewShiftMove>();
+    auto c = Configurations{Configuration(nda::vector<double>{}, nda::vector<double>{})};
+    int n_legendre = 30;
+    int n_matsubara = 100;
+    auto S = Solver(e, moves, nt, n_legendre, n_matsubara) ;
+    int n_threads = std::max(1u, std::thread::hardware_concurrency());
+    long sampling_epochs = 100000;
+    if (argc > 1) {
+        // Checkpoint prefix; an interrupted run restarted with the same
+        // prefix and thread count resumes its chains. Every chain writes ten
+        // checkpoints over its share of the sampling, however many there are.
+        S.checkpoint_file = argv[1];
+        S.checkpoint_period = std::max(
+            1L, epochs_per_walker(sampling_epochs, n_threads, world) / 10);
+    }
+    solve_parallel(S, c, n_threads, std::random_device{}(), world, 10, 1000,
+                   sampling_epochs);
+    if (world.rank() == 0) {
+        S.g[0].write_data("gmeasure.txt");
+        S.gl[0].write_data("gl.txt");
+        S.giw[0].write_data("giw.txt");
+        S.write_occupations("occupation.txt");
+        write_h5("gmeasure.h5", S.g[0]);
+        S.report_errors();
+        std::ofstream errorFile("gerror.txt");
+        for (auto err : S.g_error(0)) {
+            errorFile << err << " ";
+        }
+    }
   return 0;
 }
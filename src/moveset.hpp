@@ -0,0 +1,55 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+#include "rng.hpp"
+
+namespace tinycthyb {
+
+// Compile-time list of move generators, each a function
+// Move(Configurations &, Expansion &, Rng &) for some move type, with
+// relative proposal weights. visit hands the selected generator over as a
+// std::integral_constant, so the generator and the propose/finalize overloads
+// for its move type are resolved statically and can be inlined.
+template <auto... Generators> class MoveSet {
+public:
+  static constexpr int size = sizeof...(Generators);
+  std::array<double, size> weights;
+
+  MoveSet() { weights.fill(1.0); }
+
+  MoveSet(std::array<double, size> weights) : weights(weights) {}
+
+  int select(Rng &rng) const {
+    double total = 0.0;
+    for (auto w : weights) {
+      total += w;
+    }
+    double u = total * rng.uniform();
+    int idx = 0;
+    while (idx < size - 1 && u >= weights[idx]) {
+      u -= weights[idx];
+      idx++;
+    }
+    return idx;
+  }
+
+  // Calls f(std::integral_constant<..., G>{}) for the generator G at idx.
+  template <typename F> void visit(int idx, F &&f) const {
+    visit(idx, f, std::make_index_sequence<size>{});
+  }
+
+private:
+  template <typename F, std::size_t... I>
+  static void visit(int idx, F &f, std::index_sequence<I...>) {
+    ((idx == I ? (f(std::integral_constant<decltype(Generators), Generators>{}),
+                  0)
+               : 0),
+     ...);
+  }
+};
+
+} // namespace tinycthyb
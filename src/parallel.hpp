@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <mpi/mpi.hpp>
+#include <nda/mpi.hpp>
+#include <thread>
+#include <vector>
+
+#include "configuration.hpp"
+#include "rng.hpp"
+#include "solver.hpp"
+
+namespace tinycthyb {
+
+// Sums the accumulators over all ranks of comm, every rank ends up with the
+// totals.
+template <typename Moves>
+void mpi_reduce(Solver<Moves> &S, mpi::communicator comm) {
+  int n = S.g.size();
+  for (int a = 0; a < n; a++) {
+    S.g[a].data = mpi::all_reduce(S.g[a].data, comm);
+    S.g[a].sign = mpi::all_reduce(S.g[a].sign, comm);
+    S.gl[a].data = mpi::all_reduce(S.gl[a].data, comm);
+    S.gl[a].sign = mpi::all_reduce(S.gl[a].sign, comm);
+    S.giw[a].data = mpi::all_reduce(S.giw[a].data, comm);
+    S.giw[a].sign = mpi::all_reduce(S.giw[a].sign, comm);
+    auto &b = S.g_binning[a];
+    b.sum_x = mpi::all_reduce(b.sum_x, comm);
+    b.sum_xx = mpi::all_reduce(b.sum_xx, comm);
+    b.sum_xs = mpi::all_reduce(b.sum_xs, comm);
+    b.sum_s = mpi::all_reduce(b.sum_s, comm);
+    b.sum_ss = mpi::all_reduce(b.sum_ss, comm);
+    b.blocks = mpi::all_reduce(b.blocks, comm);
+    S.f[a].data = mpi::all_reduce(S.f[a].data, comm);
+    S.f[a].sign = mpi::all_reduce(S.f[a].sign, comm);
+    S.fiw[a].data = mpi::all_reduce(S.fiw[a].data, comm);
+    S.fiw[a].sign = mpi::all_reduce(S.fiw[a].sign, comm);
+  }
+  S.occupation = mpi::all_reduce(S.occupation, comm);
+  S.double_occupancy = mpi::all_reduce(S.double_occupancy, comm);
+  S.move_prop = mpi::all_reduce(S.move_prop, comm);
+  S.move_acc = mpi::all_reduce(S.move_acc, comm);
+}
+
+// Chain states of the walkers of one rank at the end of a run, from which a
+// later run continues instead of starting over.
+struct Chains {
+  std::vector<Configurations> configuration;
+  std::vector<Rng> rng;
+
+  // Whether there is a state for each of n_threads walkers.
+  bool ready(int n_threads) const {
+    return configuration.size() == static_cast<std::size_t>(n_threads);
+  }
+};
+
+// Runs run(walker, resumed) for n_threads copies of S on every rank of comm and
+// sums the results into S. Each walker gets its own stream of the generator
+// seeded with seed, or the configuration and generator left in chains by an
+// earlier run, which then receives the new final states. When
+// S.checkpoint_period is set, every walker checkpoints to S.checkpoint_file
+// with its index appended, and a walker whose checkpoint already exists is
+// restored from it first, with resumed set.
+template <typename Moves, typename Run>
+void run_walkers(Solver<Moves> &S, int n_threads, std::uint64_t seed,
+                 mpi::communicator comm, Run run, Chains *chains = nullptr) {
+  std::vector<Solver<Moves>> walkers(n_threads, S);
+  std::vector<std::thread> threads;
+  bool warm = chains != nullptr && chains->ready(n_threads);
+  for (int t = 0; t < n_threads; t++) {
+    walkers[t].verbose = S.verbose && comm.rank() == 0 && t == 0;
+    walkers[t].rng = Rng(seed, comm.rank() * n_threads + t);
+    if (warm) {
+      walkers[t].configuration = chains->configuration[t];
+      walkers[t].rng = chains->rng[t];
+    }
+    if (S.checkpoint_period > 0) {
+      walkers[t].checkpoint_file = S.checkpoint_file + "." +
+                                   std::to_string(comm.rank() * n_threads + t);
+    }
+    threads.emplace_back([&, t]() {
+      auto &w = walkers[t];
+      bool resumed = w.checkpoint_period > 0 &&
+                     std::filesystem::exists(w.checkpoint_file) &&
+                     w.load_checkpoint(w.checkpoint_file) == 0;
+      run(w, resumed);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  for (auto &walker : walkers) {
+    S.merge(walker);
+  }
+  if (chains != nullptr) {
+    chains->configuration.clear();
+    chains->rng.clear();
+    for (auto &walker : walkers) {
+      chains->configuration.push_back(walker.configuration);
+      chains->rng.push_back(walker.rng);
+    }
+  }
+  mpi_reduce(S, comm);
+}
+
+// Share of sampling_epochs of each of the n_threads chains on every rank of
+// comm, rounded up.
+long epochs_per_walker(long sampling_epochs, int n_threads,
+                       mpi::communicator comm = {}) {
+  long n_walkers = n_threads * comm.size();
+  return (sampling_epochs + n_walkers - 1) / n_walkers;
+}
+
+// Runs n_threads independent Markov chains on every rank of comm, starting from
+// copies of S and c. Each chain does its own warmup and an equal share of
+// sampling_epochs; resumed chains only sample what is left of their share.
+template <typename Moves>
+void solve_parallel(Solver<Moves> &S, Configurations c, int n_threads,
+                    std::uint64_t seed, mpi::communicator comm = {},
+                    int epoch_steps = 10, int warmup_epochs = 1000,
+                    long sampling_epochs = 100000) {
+  int n_walkers = n_threads * comm.size();
+  long walker_epochs = epochs_per_walker(sampling_epochs, n_threads, comm);
+
+  if (S.verbose && comm.rank() == 0) {
+    std::cout << "Running " << n_walkers << " Markov chains with "
+              << walker_epochs << " sampling epochs each." << std::endl;
+  }
+
+  run_walkers(S, n_threads, seed, comm, [&](Solver<Moves> &w, bool resumed) {
+    if (resumed) {
+      w.solve(w.configuration, epoch_steps, 0,
+              walker_epochs - w.sampled_epochs);
+    } else {
+      w.solve(c, epoch_steps, warmup_epochs, walker_epochs);
+    }
+  });
+}
+
+// Adaptive variant: every chain stops once its own G(tau) error is below
+// conv.tolerance * sqrt(number of chains), which the sum over all chains
+// then meets, or at the limits of conv. Resumed chains skip the warmup, and
+// the epochs they sampled before count against conv.max_sampling_epochs.
+// With chains, the walkers continue from the states of an earlier call
+// rather than from c, and leave their final states there.
+template <typename Moves>
+void solve_parallel(Solver<Moves> &S, Configurations c, int n_threads,
+                    std::uint64_t seed, mpi::communicator comm,
+                    Convergence conv, Chains *chains = nullptr) {
+  bool warm = chains != nullptr && chains->ready(n_threads);
+  int n_walkers = n_threads * comm.size();
+  conv.tolerance *= std::sqrt(static_cast<double>(n_walkers));
+
+  if (S.verbose && comm.rank() == 0) {
+    std::cout << "Running " << n_walkers << " Markov chains to a G(tau) error"
+              << " of " << conv.tolerance << " each." << std::endl;
+  }
+
+  run_walkers(S, n_threads, seed, comm, [&](Solver<Moves> &w, bool resumed) {
+    auto walker_conv = conv;
+    if (resumed) {
+      walker_conv.min_warmup_epochs = 0;
+      walker_conv.max_warmup_epochs = 0;
+      walker_conv.min_sampling_epochs =
+          std::max(0L, conv.min_sampling_epochs - w.sampled_epochs);
+      walker_conv.max_sampling_epochs =
+          std::max(0L, conv.max_sampling_epochs - w.sampled_epochs);
+      w.solve(w.configuration, walker_conv);
+    } else {
+      w.solve(warm ? w.configuration : c, walker_conv);
+    }
+  }, chains);
+}
+
+} // namespace tinycthyb
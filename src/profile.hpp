@@ -0,0 +1,132 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "allocations.hpp"
+#include "binning.hpp"
+
+namespace tinycthyb {
+
+#ifdef TINYCTHYB_PROFILE
+
+// Wall time per move type and for the measurements, the expansion order
+// histogram and the integrated autocorrelation time of the expansion order,
+// collected around the Monte Carlo loop when TINYCTHYB_PROFILE is defined, in
+// memory that does not grow with the length of the run.
+// With TINYCTHYB_COUNT_ALLOCATIONS also the heap allocations of the moves and
+// measurements, each charged with those since the previous one.
+class Profile {
+public:
+  using time_point = std::chrono::steady_clock::time_point;
+
+  void resize(int n_moves) {
+    move_time.assign(n_moves, 0.0);
+    move_allocations.assign(n_moves, 0);
+  }
+
+  time_point now() const { return std::chrono::steady_clock::now(); }
+
+  // Called on the thread that runs the chain, whose allocations are counted.
+  void begin() { last_allocations = allocation_count(); }
+
+  void update(int move_idx, time_point start) {
+    move_time[move_idx] += seconds_since(start);
+    move_allocations[move_idx] += new_allocations();
+  }
+
+  void measurement(time_point start, int order) {
+    measurement_time += seconds_since(start);
+    measurement_allocations += new_allocations();
+    histogram[order] += 1;
+    double x = order;
+    order_binning.add(&x, 1.0);
+    last_allocations = allocation_count();
+  }
+
+  template <typename Stats>
+  void report(const Stats &move_prop, const Stats &move_acc) const {
+    double update_time = 0.0;
+    for (auto t : move_time) {
+      update_time += t;
+    }
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "Profile: updates " << update_time << " s, measurements "
+              << measurement_time << " s" << std::endl;
+    for (int m = 0; m < static_cast<int>(move_time.size()); m++) {
+      std::cout << "  move " << m << ": " << move_time[m] << " s, "
+                << 1e9 * move_time[m] / std::max(1.0, (double)move_prop(m))
+                << " ns/step, acceptance "
+                << move_acc(m) / std::max(1.0, (double)move_prop(m));
+#ifdef TINYCTHYB_COUNT_ALLOCATIONS
+      std::cout << ", allocations/step "
+                << move_allocations[m] / std::max(1.0, (double)move_prop(m));
+#endif
+      std::cout << std::endl;
+    }
+#ifdef TINYCTHYB_COUNT_ALLOCATIONS
+    std::cout << "  allocations/measurement "
+              << measurement_allocations /
+                     std::max(1.0, (double)order_binning.count())
+              << std::endl;
+#endif
+    std::cout << "  expansion order histogram:";
+    for (auto [order, count] : histogram) {
+      std::cout << " " << order << ":" << count;
+    }
+    std::cout << std::endl;
+    std::cout << "  expansion order autocorrelation time "
+              << autocorrelation_time() << " measurements" << std::endl;
+    std::cout << std::defaultfloat;
+  }
+
+  // Integrated autocorrelation time from the binning of the expansion order,
+  // 0.5 for independent measurements.
+  double autocorrelation_time() const {
+    return order_binning.autocorrelation_time()(0);
+  }
+
+private:
+  std::vector<double> move_time;
+  double measurement_time = 0.0;
+  std::map<int, long> histogram;
+  Binning order_binning{1};
+  std::vector<long> move_allocations;
+  long measurement_allocations = 0;
+  long last_allocations = 0;
+
+  long new_allocations() {
+    long count = allocation_count();
+    long n = count - last_allocations;
+    last_allocations = count;
+    return n;
+  }
+
+  double seconds_since(time_point start) const {
+    return std::chrono::duration<double>(now() - start).count();
+  }
+};
+
+#else
+
+// Empty stand-in used when TINYCTHYB_PROFILE is not defined, so that the
+// instrumentation compiles away.
+class Profile {
+public:
+  using time_point = int;
+
+  void resize(int) {}
+  time_point now() const { return 0; }
+  void begin() {}
+  void update(int, time_point) {}
+  void measurement(time_point, int) {}
+  template <typename Stats> void report(const Stats &, const Stats &) const {}
+};
+
+#endif
+
+} // namespace tinycthyb
@@ -0,0 +1,43 @@
+#include "green.hpp"
+#include "replica.hpp"
+#include "solver.hpp"
+#include <random>
+#include <string>
+
+using namespace tinycthyb;
+
+// Replica exchange on a ladder of temperatures down to beta = 20, one thread
+// per replica; writes gmeasure_<r>.txt for replica r.
+int main(int argc, char *argv[]) {
+
+  std::vector<double> betas{10, 12, 14, 17, 20};
+  int n = betas.size();
+  double h = 0;
+  int nt = 200;
+
+  std::vector<Hybridization> Delta;
+  for (auto beta : betas) {
+    Delta.push_back(semi_circular_hybridization(beta, nt));
+  }
+  std::vector<Expansion> expansions;
+  expansions.reserve(n);
+  for (int r = 0; r < n; r++) {
+    expansions.emplace_back(betas[r], h, Delta[r]);
+  }
+  auto moves = MoveSet<NewSegmentInsertionMove, NewAntiSegmentInsertionMove,
+                       NewSegmentRemoveMove, NewAntiSegmentRemoveMove,
+                       NewShiftMove>();
+  std::vector<Solver<decltype(moves)>> replicas;
+  replicas.reserve(n);
+  for (auto &e : expansions) {
+    replicas.emplace_back(e, moves, nt);
+  }
+
+  auto c = Configurations{
+      Configuration(nda::vector<double>{}, nda::vector<double>{})};
+  solve_replica_exchange(replicas, c, std::random_device{}());
+  for (int r = 0; r < n; r++) {
+    replicas[r].g[0].write_data("gmeasure_" + std::to_string(r) + ".txt");
+  }
+  return 0;
+}
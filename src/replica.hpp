@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <barrier>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <nda/nda.hpp>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "configuration.hpp"
+#include "rng.hpp"
+#include "solver.hpp"
+
+namespace tinycthyb {
+
+// Proposes to exchange the configurations of the chains r and s, each with
+// its times rescaled to the beta of the other chain. The weights are those
+// of log_eval(), compared in log space, and the rescaling of the 2k operator
+// times of either configuration enters as the Jacobian
+// (beta_s / beta_r)^(2 k_r - 2 k_s).
+template <typename Moves>
+bool exchange(Solver<Moves> &r, Solver<Moves> &s, Rng &rng) {
+  auto &e_r = r.expansion();
+  auto &e_s = s.expansion();
+  auto c_r = rescale(r.configuration, e_s.beta / e_r.beta);
+  auto c_s = rescale(s.configuration, e_r.beta / e_s.beta);
+  int k = expansion_order(r.configuration) - expansion_order(s.configuration);
+  auto R = log_eval(c_r, e_s) * log_eval(c_s, e_r) /
+           (log_eval(r.configuration, e_r) * log_eval(s.configuration, e_s));
+  if (!(R.log + 2 * k * std::log(e_s.beta / e_r.beta) >
+        std::log(rng.uniform()))) {
+    return false;
+  }
+  r.start(c_s);
+  s.start(c_r);
+  return true;
+}
+
+// Replica exchange: one chain per replica, each on its own thread and each
+// with its own expansion, e.g. a ladder of beta or h. Every exchange_period
+// epochs of warmup or sampling the chains meet at a barrier, where swaps
+// between the replicas r and r + 1 are proposed, for even r and odd r in
+// turn, so the configurations of low-temperature replicas decorrelate through
+// the faster high-temperature ones. Every replica measures its own G(tau)
+// throughout. Replica r uses stream r of the generator seeded with seed and
+// the swaps stream n. Returns the acceptance rate of the swaps between r and
+// r + 1. An exception thrown by a swap stops all chains at that barrier and
+// is rethrown here.
+template <typename Moves>
+nda::vector<double> solve_replica_exchange(
+    std::vector<Solver<Moves>> &replicas, Configurations c,
+    std::uint64_t seed, int epoch_steps = 10, int warmup_epochs = 1000,
+    long sampling_epochs = 100000, int exchange_period = 10) {
+  if (exchange_period <= 0) {
+    throw std::invalid_argument("exchange_period must be positive");
+  }
+  int n = replicas.size();
+  auto proposed = nda::zeros<double>(std::max(n - 1, 0));
+  auto accepted = nda::zeros<double>(std::max(n - 1, 0));
+  Rng rng(seed, n);
+  long round = 0;
+  // The completion of a barrier must not throw.
+  std::exception_ptr error;
+  auto swap = [&]() noexcept {
+    try {
+      for (int r = round % 2; r + 1 < n; r += 2) {
+        proposed(r) += 1;
+        if (exchange(replicas[r], replicas[r + 1], rng)) {
+          accepted(r) += 1;
+        }
+      }
+    } catch (...) {
+      error = std::current_exception();
+    }
+    round++;
+  };
+  std::barrier sync(n, swap);
+
+  bool verbose = n > 0 && replicas[0].verbose;
+  std::vector<std::thread> threads;
+  for (int r = 0; r < n; r++) {
+    threads.emplace_back([&, r]() {
+      auto &S = replicas[r];
+      S.verbose = false;
+      S.rng = Rng(seed, r);
+      S.start(c);
+      long warmup_left = warmup_epochs;
+      long sampling_left = sampling_epochs;
+      while (warmup_left > 0 || sampling_left > 0) {
+        if (warmup_left > 0) {
+          long epochs = std::min<long>(exchange_period, warmup_left);
+          S.warmup(epoch_steps, epochs);
+          warmup_left -= epochs;
+        } else {
+          long epochs = std::min<long>(exchange_period, sampling_left);
+          S.sample(epoch_steps, epochs);
+          sampling_left -= epochs;
+        }
+        sync.arrive_and_wait();
+        if (error) {
+          break;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  auto rate = nda::zeros<double>(std::max(n - 1, 0));
+  for (int r = 0; r + 1 < n; r++) {
+    rate(r) = proposed(r) > 0 ? accepted(r) / proposed(r) : 0.0;
+  }
+  if (verbose) {
+    for (int r = 0; r + 1 < n; r++) {
+      std::cout << "Replicas " << r << " and " << r + 1 << ": swap acceptance "
+                << rate(r) << std::endl;
+    }
+    for (int r = 0; r < n; r++) {
+      std::cout << "Replica " << r << ": ";
+      replicas[r].report_errors();
+    }
+  }
+  return rate;
+}
+
+} // namespace tinycthyb
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <limits>
+
+namespace tinycthyb {
+
+// xoshiro256** generator (Blackman & Vigna). The state is seeded through
+// splitmix64, and independent streams for parallel chains are obtained by
+// jumping 2^128 draws ahead once per stream index.
+class Rng {
+public:
+  using result_type = std::uint64_t;
+  std::array<std::uint64_t, 4> state;
+
+  Rng(std::uint64_t seed = 0, std::uint64_t stream = 0) {
+    std::uint64_t x = seed;
+    for (auto &s : state) {
+      s = splitmix64(x);
+    }
+    for (std::uint64_t i = 0; i < stream; i++) {
+      jump();
+    }
+  }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() {
+    return std::numeric_limits<result_type>::max();
+  }
+
+  result_type operator()() {
+    const std::uint64_t result = rotl(state[1] * 5, 7) * 9;
+    const std::uint64_t t = state[1] << 17;
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = rotl(state[3], 45);
+    return result;
+  }
+
+  // Uniform in [0, 1).
+  double uniform() { return ((*this)() >> 11) * 0x1.0p-53; }
+
+  // Uniform integer in [min, max].
+  int randint(int min, int max) {
+    std::uint64_t range = static_cast<std::uint64_t>(max - min) + 1;
+    return min + static_cast<int>((((*this)() >> 32) * range) >> 32);
+  }
+
+  void jump() {
+    static constexpr std::uint64_t JUMP[] = {
+        0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa,
+        0x39abdc4529b1661c};
+    std::array<std::uint64_t, 4> s = {0, 0, 0, 0};
+    for (auto jump : JUMP) {
+      for (int b = 0; b < 64; b++) {
+        if (jump & (std::uint64_t{1} << b)) {
+          for (int i = 0; i < 4; i++) {
+            s[i] ^= state[i];
+          }
+        }
+        (*this)();
+      }
+    }
+    state = s;
+  }
+
+private:
+  static std::uint64_t rotl(std::uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+  }
+
+  static std::uint64_t splitmix64(std::uint64_t &x) {
+    std::uint64_t z = (x += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+  }
+};
+
+} // namespace tinycthyb
@@ -86,18 +86,23 @@ private:
 SegmentIterator segments(Configuration &c) { return SegmentIterator(c); }
 
 std::optional<Segment> onsegment(double t, Configuration &c) {
-  for (auto s : segments(c)) {
-    if (s.onsegment(t)) {
-      return s;
-    }
+  if (!c.occupied(t)) {
+    return std::nullopt;
+  }
+  auto [i_idx, f_idx] = c.preceding(t);
+  if (c.t_i((i_idx + 1) % c.length()) == t ||
+      c.t_f((f_idx + 1) % c.length()) == t) {
+    return std::nullopt;
   }
-  return std::nullopt;
+  i_idx = i_idx < 0 ? c.length() - 1 : i_idx;
+  return Segment(c.t_i(i_idx), c.t_f((f_idx + 1) % c.length()));
 }
 
 void remove_segment(Configuration &c, int segment_idx) {
   auto [i_idx, f_idx] = segments(c).indices(segment_idx);
-  c.t_i = deleteat(c.t_i, i_idx);
-  c.t_f = deleteat(c.t_f, f_idx);
+  auto move = RemovalMove(i_idx, f_idx, 0.0);
+  c.remove(move);
+  c.commit();
 }
 
 bool is_segment_proper(Configuration &c) {
@@ -1,80 +1,250 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <functional>
 #include <limits>
 #include <math.h>
 #include <nda/linalg/det_and_inverse.hpp>
 #include <nda/nda.hpp>
-#include <variant>
+#include <stdexcept>
 #include <vector>
 
+#include "binning.hpp"
+#include "checkpoint.hpp"
 #include "configuration.hpp"
 #include "segment.hpp"
 #include "antisegment.hpp"
+#include "fastupdate.hpp"
+#include "green.hpp"
 #include "hybridization.hpp"
+#include "moveset.hpp"
+#include "profile.hpp"
+#include "rng.hpp"
 #include "util.hpp"
 
 namespace tinycthyb {
 
+// Local expansion of N flavors with levels h(a) and a density-density
+// interaction U(a, b), each flavor coupling to its own bath Delta[a]. The sets
+// of empty flavors are bit masks, hence at most max_flavors flavors.
 struct Expansion {
+  static constexpr int max_flavors = 32;
+
   double beta;
-  double h;
-  Hybridization &Delta;
+  nda::vector<double> h;
+  nda::matrix<double> U;
+  std::vector<std::reference_wrapper<Hybridization>> Delta;
+
   Expansion(double beta, double h, Hybridization &Delta)
-      : beta(beta), h(h), Delta(Delta) {}
+      : beta(beta), h(nda::vector<double>{h}), U(nda::zeros<double>(1, 1)),
+        Delta{Delta} {}
+
+  Expansion(double beta, nda::vector<double> h, nda::matrix<double> U,
+            std::vector<std::reference_wrapper<Hybridization>> Delta)
+      : beta(beta), h(h), U(U), Delta(Delta) {
+    if (h.size() > max_flavors) {
+      throw std::invalid_argument("Expansion supports at most 32 flavors");
+    }
+  }
+
+  int flavors() const { return h.size(); }
 };
 
+// Determinant of the hybridization matrix with t_f rolled so that a segment
+// winding around beta comes last. The rows are filled in place from the
+// configuration, with the roll folded into the row index.
 struct Determinant {
 public:
-  nda::vector<double> t_i;
-  nda::vector<double> t_f;
   nda::matrix<double> mat;
+  LogValue log_value;
   double value;
 
-  Determinant(Configuration &c, Expansion &e) {
-    t_f = c.t_f;
-    t_i = c.t_i;
+  Determinant(Configuration &c, Expansion &e, int flavor = 0) {
+    int k = c.length();
+    int shift = (k > 0 && c.t_f(0) < c.t_i(0)) ? 1 : 0;
+    mat = nda::zeros<double>(k, k);
+    for (int j = 0; j < k; j++) {
+      e.Delta[flavor].get().row(c.t_f((j + k - shift) % k), c.t_i.data(), k,
+                                &mat(j, 0));
+    }
+    log_value = log_determinant(mat);
+    value = log_value.value();
+  }
+};
 
-    if (t_f.size() > 0 && t_f(0) < t_i(0)) {
-      t_f = roll(t_f, -1);
+// Flavors without operators are either empty or occupied over the whole
+// interval, and both states are summed over.
+std::uint32_t empty_flavors(Configurations &c) {
+  std::uint32_t empty = 0;
+  int n = c.size();
+  for (int a = 0; a < n; a++) {
+    if (c[a].length() == 0) {
+      empty |= std::uint32_t{1} << a;
     }
+  }
+  return empty;
+}
 
-    mat = nda::zeros<double>(t_i.size(), t_f.size());
-    for (int i = 0; i < t_i.size(); i++) {
-      for (int j = 0; j < t_f.size(); j++) {
-        mat(j, i) = e.Delta(t_f(j) - t_i(i));
+// Local exponent of the empty flavors in the subset full being occupied.
+double empty_flavor_exponent(Configurations &c, Expansion &e,
+                             std::uint32_t full) {
+  double exponent = 0.0;
+  int n = c.size();
+  for (int a = 0; a < n; a++) {
+    if (!(full & (std::uint32_t{1} << a))) {
+      continue;
+    }
+    exponent -= e.h(a) * e.beta;
+    for (int b = 0; b < n; b++) {
+      if (b > a && (full & (std::uint32_t{1} << b))) {
+        exponent -= e.U(a, b) * e.beta;
+      } else if (c[b].length() > 0) {
+        exponent -= e.U(a, b) * c[b].occupation(e.beta);
       }
     }
-    value = determinant(mat);
   }
-};
+  return exponent;
+}
 
-double trace(Configuration &c, Expansion &e) {
-  if (c.length() == 0) {
-    return 2.0;
-  }
-  if (!is_segment_proper(c)) {
+// Enumerates the subsets of the empty flavors, which is a single term when
+// none is empty. The terms are summed relative to the largest, so that a
+// deep level at large beta does not overflow.
+double log_empty_flavor_weight(Configurations &c, Expansion &e) {
+  std::uint32_t empty = empty_flavors(c);
+  if (empty == 0) {
     return 0.0;
   }
-  double value = (c.t_f(0) < c.t_i(0)) ? -1.0 : +1.0;
+  double max = -std::numeric_limits<double>::infinity();
+  for (std::uint32_t full = empty;; full = (full - 1) & empty) {
+    max = std::max(max, empty_flavor_exponent(c, e, full));
+    if (full == 0) {
+      break;
+    }
+  }
+  double weight = 0.0;
+  for (std::uint32_t full = empty;; full = (full - 1) & empty) {
+    weight += std::exp(empty_flavor_exponent(c, e, full) - max);
+    if (full == 0) {
+      break;
+    }
+  }
+  return max + std::log(weight);
+}
+
+double empty_flavor_weight(Configurations &c, Expansion &e) {
+  return std::exp(log_empty_flavor_weight(c, e));
+}
+
+// P(a, b): probability that the empty flavors a and b are both occupied, and
+// P(a, a) that a is, given the operators of the other flavors. Zero for
+// flavors with operators. P is N x N and filled in place.
+void empty_flavor_occupation(Configurations &c, Expansion &e,
+                             nda::matrix<double> &P) {
+  int n = c.size();
+  P = 0.0;
+  std::uint32_t empty = empty_flavors(c);
+  if (empty == 0) {
+    return;
+  }
+  double log_weight = log_empty_flavor_weight(c, e);
+  for (std::uint32_t full = empty;; full = (full - 1) & empty) {
+    double w = std::exp(empty_flavor_exponent(c, e, full) - log_weight);
+    for (int a = 0; a < n; a++) {
+      for (int b = 0; b < n; b++) {
+        if ((full >> a & 1) && (full >> b & 1)) {
+          P(a, b) += w;
+        }
+      }
+    }
+    if (full == 0) {
+      break;
+    }
+  }
+}
+
+// exp(-sum_a h_a L_a - sum_{a<b} U_ab O_ab) with the sign of the segments
+// wrapping around beta, where L_a is the occupation of flavor a and O_ab the
+// overlap of flavors a and b. O(N^2 k), the moves use trace_ratio instead.
+LogValue log_trace(Configurations &c, Expansion &e) {
+  int sign = 1;
+  double exponent = 0.0;
+  int n = c.size();
+  for (int a = 0; a < n; a++) {
+    if (c[a].length() == 0) {
+      continue;
+    }
+    if (c[a].t_f(0) < c[a].t_i(0)) {
+      sign = -sign;
+    }
+    exponent -= e.h(a) * c[a].occupation(e.beta);
+    for (int b = a + 1; b < n; b++) {
+      if (e.U(a, b) == 0.0 || c[b].length() == 0) {
+        continue;
+      }
+      for (auto s : segments(c[a])) {
+        exponent -= e.U(a, b) * c[b].overlap(s.t_i, s.t_f, e.beta);
+      }
+    }
+  }
+  return LogValue(exponent + log_empty_flavor_weight(c, e), sign);
+}
+
+double trace(Configurations &c, Expansion &e) {
+  return log_trace(c, e).value();
+}
+
+double trace(Configuration &c, Expansion &e) {
+  auto cs = Configurations{c};
+  return trace(cs, e);
+}
+
+// |trace| ratio of a trial move on flavor a, already applied to c, that
+// flipped the occupation between t1 and t2 and changed the occupation of a by
+// dL. Only the overlaps of that interval with the other flavors enter, which
+// is O(N log k) plus the operators inside the interval. log_weight is the
+// log_empty_flavor_weight before the move.
+double trace_ratio(Configurations &c, Expansion &e, int a, double dL,
+                   double t1, double t2, double log_weight) {
+  double overlap = 0.0;
+  int n = c.size();
+  for (int b = 0; b < n; b++) {
+    if (b != a && e.U(a, b) != 0.0) {
+      overlap += e.U(a, b) * c[b].overlap(t1, t2, e.beta);
+    }
+  }
+  double exponent = -e.h(a) * dL - (dL > 0.0 ? overlap : -overlap);
+  return std::exp(exponent + log_empty_flavor_weight(c, e) - log_weight);
+}
 
-  for (auto s : segments(c)) {
-    value *= std::exp(-e.h * s.length(e.beta));
+LogValue log_eval(Configurations &c, Expansion &e) {
+  LogValue value = log_trace(c, e);
+  int n = c.size();
+  for (int a = 0; a < n; a++) {
+    if (c[a].length() > 0) {
+      value *= Determinant(c[a], e, a).log_value;
+    }
   }
   return value;
 }
 
-double eval(Configuration &c, Expansion &e) {
-  return trace(c, e) * Determinant(c, e).value;
+double eval(Configurations &c, Expansion &e) { return log_eval(c, e).value(); }
+
+int random_flavor(Configurations &c, Rng &rng) {
+  return c.size() > 1 ? rng.randint(0, c.size() - 1) : 0;
 }
 
 // moves
-InsertMove NewSegmentInsertionMove(Configuration &c, Expansion &e) {
+InsertMove NewSegmentInsertionMove(Configurations &cs, Expansion &e,
+                                   Rng &rng) {
+  int a = random_flavor(cs, rng);
+  auto &c = cs[a];
   double l;
   double t_f;
-  double t_i = e.beta * nda::rand<>();
+  double t_i = e.beta * rng.uniform();
   if (c.length() == 0) {
-    t_f = e.beta * nda::rand<>();
+    t_f = e.beta * rng.uniform();
     l = e.beta;
   } else {
     auto s = onantisegment(t_i, c);
@@ -83,17 +253,20 @@ InsertMove NewSegmentInsertionMove(Configuration &c, Expansion &e) {
     } else {
       l = 0.0;
     }
-    t_f = fmod((t_i + l * nda::rand<>()), e.beta);
+    t_f = fmod((t_i + l * rng.uniform()), e.beta);
   }
-  return InsertMove(t_i, t_f, l);
+  return InsertMove(t_i, t_f, l, a);
 }
 
-InsertMove NewAntiSegmentInsertionMove(Configuration &c, Expansion &e) {
+InsertMove NewAntiSegmentInsertionMove(Configurations &cs, Expansion &e,
+                                       Rng &rng) {
+  int a = random_flavor(cs, rng);
+  auto &c = cs[a];
   double l;
   double t_f;
-  double t_i = e.beta * nda::rand<>();
+  double t_i = e.beta * rng.uniform();
   if (c.length() == 0) {
-    t_f = e.beta * nda::rand<>();
+    t_f = e.beta * rng.uniform();
     l = e.beta;
   } else {
     auto s = onsegment(t_i, c);
@@ -102,144 +275,769 @@ InsertMove NewAntiSegmentInsertionMove(Configuration &c, Expansion &e) {
     } else {
       l = 0.0;
     }
-    t_f = fmod((t_i + l * nda::rand<>()), e.beta);
+    t_f = fmod((t_i + l * rng.uniform()), e.beta);
   }
-  return InsertMove(t_f, t_i, l);
+  return InsertMove(t_f, t_i, l, a);
 }
 
-RemovalMove NewSegmentRemoveMove(Configuration &c, Expansion &e) {
+RemovalMove NewSegmentRemoveMove(Configurations &cs, Expansion &e, Rng &rng) {
+  int a = random_flavor(cs, rng);
+  auto &c = cs[a];
   if (c.length() > 0) {
-    auto idx = randomint(0, c.length() - 1);
+    auto idx = rng.randint(0, c.length() - 1);
     auto [i_idx, f_idx] = segments(c).indices(idx);
     auto s = Segment(c.t_i(i_idx), c.t_i((i_idx + 1) % c.length()));
     auto l = s.length(e.beta);
-    return RemovalMove(i_idx, f_idx, l);
+    return RemovalMove(i_idx, f_idx, l, a);
   } else {
-    return RemovalMove(0, 0, 0.0);
+    return RemovalMove(0, 0, 0.0, a);
   }
 }
 
-RemovalMove NewAntiSegmentRemoveMove(Configuration &c, Expansion &e) {
+RemovalMove NewAntiSegmentRemoveMove(Configurations &cs, Expansion &e,
+                                     Rng &rng) {
+  int a = random_flavor(cs, rng);
+  auto &c = cs[a];
   if (c.length() > 0) {
-    auto idx = randomint(0, c.length() - 1);
+    auto idx = rng.randint(0, c.length() - 1);
     auto [f_idx, i_idx] = antisegments(c).indices(idx);
     auto s = AntiSegment(c.t_f(f_idx), c.t_f((f_idx + 1) % c.length()));
     auto l = s.length(e.beta);
-    return RemovalMove(i_idx, f_idx, l);
+    return RemovalMove(i_idx, f_idx, l, a);
   } else {
-    return RemovalMove(0, 0, 0.0);
+    return RemovalMove(0, 0, 0.0, a);
+  }
+}
+
+// Picks one operator of a random flavor and a new time for it uniformly
+// between its neighbours of the other kind, which the shift leaves in place.
+ShiftMove NewShiftMove(Configurations &cs, Expansion &e, Rng &rng) {
+  int a = random_flavor(cs, rng);
+  auto &c = cs[a];
+  int k = c.length();
+  if (k == 0) {
+    return ShiftMove(0, false, 0.0, 0.0, a);
   }
+  int idx = rng.randint(0, 2 * k - 1);
+  bool creator = idx >= k;
+  idx = creator ? idx - k : idx;
+  // Neighbours of t_f are the t_i before and after it, and vice versa.
+  auto &own = creator ? c.t_i : c.t_f;
+  auto &other = creator ? c.t_f : c.t_i;
+  auto [i_idx, f_idx] = c.preceding(own(idx));
+  int prev = creator ? f_idx : i_idx;
+  prev = prev < 0 ? k - 1 : prev;
+  double t0 = other(prev);
+  double l = k == 1 ? e.beta : Segment(t0, other((prev + 1) % k)).length(e.beta);
+  double t = fmod(t0 + l * rng.uniform(), e.beta);
+  return ShiftMove(idx, creator, t, l, a);
+}
+
+FlipMove NewFlipMove(Configurations &cs, Expansion &e, Rng &rng) {
+  return FlipMove(random_flavor(cs, rng));
 }
 
-using Moves = std::variant<InsertMove, RemovalMove>;
-using MoveFunc = std::function<Moves(Configuration &, Expansion &)>;
+// Global flip of two random flavors, e.g. the two spins of an orbital.
+SwapMove NewSwapMove(Configurations &cs, Expansion &e, Rng &rng) {
+  int n = cs.size();
+  if (n < 2) {
+    return SwapMove(0, 0);
+  }
+  int a = rng.randint(0, n - 1);
+  int b = rng.randint(0, n - 2);
+  return SwapMove(a, b < a ? b : b + 1);
+}
 
-class Solver {
+using DefaultMoves =
+    MoveSet<NewSegmentInsertionMove, NewAntiSegmentInsertionMove,
+            NewSegmentRemoveMove, NewAntiSegmentRemoveMove, NewShiftMove>;
+
+// Stopping rules of the adaptive Solver::solve. The defaults never stop
+// earlier than the fixed schedule would end, unless tolerance is set.
+struct Convergence {
+  int epoch_steps = 10;
+  // Warmup ends when the averages over two consecutive windows of
+  // warmup_window epochs agree within warmup_tolerance (relative for the
+  // expansion order, absolute for the sign).
+  int warmup_window = 100;
+  double warmup_tolerance = 0.05;
+  int min_warmup_epochs = 200;
+  int max_warmup_epochs = 1000;
+  // Sampling ends when the largest G(tau) error is below tolerance, checked
+  // every check_period epochs.
+  double tolerance = 0.0;
+  long check_period = 1000;
+  long min_sampling_epochs = 1000;
+  long max_sampling_epochs = 100000;
+  // Wall-clock budget in seconds for warmup and sampling together.
+  double max_seconds = std::numeric_limits<double>::infinity();
+};
+
+template <typename Moves = DefaultMoves> class Solver {
 private:
-  Hybridization &Delta;
   Expansion &e;
+  GreensFunction g_sample; // G(tau) bins of the current measurement
+  nda::vector<double> row_weight;
+  nda::vector<double> row;
+  nda::matrix<double> P; // empty_flavor_occupation of the current measurement
 
 public:
-  std::vector<MoveFunc> moves;
-  GreensFunction g;
+  Moves moves;
+  Rng rng;
+  std::vector<FastUpdate> d;
+  std::vector<GreensFunction> g;
+  std::vector<LegendreGreensFunction> gl;
+  std::vector<MatsubaraGreensFunction> giw;
+  std::vector<Binning> g_binning;
+  // Improved estimator F(tau) = (Sigma G)(tau), so that Sigma = F / G, in the
+  // normalization of g and giw.
+  std::vector<GreensFunction> f;
+  std::vector<MatsubaraGreensFunction> fiw;
+  // Sums of sign * <n_a> and sign * <n_a n_b> over the samples, normalized by
+  // the sign sum g[a].sign.
+  nda::vector<double> occupation;
+  nda::matrix<double> double_occupancy;
   int nt;
   nda::vector<double> move_prop;
   nda::vector<double> move_acc;
+  bool verbose = true;
+  Profile profile;
+
+  // State of the chain after the last solve, and the number of sampling
+  // epochs in the accumulators.
+  Configurations configuration;
+  long sampled_epochs = 0;
+
+  // Checkpoint written at the end of the warmup and every checkpoint_period
+  // sampling epochs, 0 disables it.
+  std::string checkpoint_file;
+  long checkpoint_period = 0;
+
+  // One block of the determinant and one set of accumulators per flavor.
+  Solver(Expansion &e, Moves moves, int nt, int n_legendre = 0,
+         int n_matsubara = 0, std::uint64_t seed = 0)
+      : e(e), g_sample(e.beta, nt), moves(moves), rng(seed), nt(nt) {
+    for (int a = 0; a < e.flavors(); a++) {
+      d.emplace_back(e.Delta[a]);
+      g.emplace_back(e.beta, nt);
+      gl.emplace_back(e.beta, n_legendre);
+      giw.emplace_back(e.beta, n_matsubara);
+      g_binning.emplace_back(nt);
+      f.emplace_back(e.beta, nt);
+      fiw.emplace_back(e.beta, n_matsubara);
+    }
+    occupation = nda::zeros<double>(e.flavors());
+    double_occupancy = nda::zeros<double>(e.flavors(), e.flavors());
+    P = nda::zeros<double>(e.flavors(), e.flavors());
+    move_prop = nda::zeros<double>(Moves::size);
+    move_acc = nda::zeros<double>(Moves::size);
+    profile.resize(Moves::size);
+  }
+
+  Solver(Expansion &e, int nt, int n_legendre = 0, int n_matsubara = 0,
+         std::uint64_t seed = 0)
+      : Solver(e, Moves(), nt, n_legendre, n_matsubara, seed) {}
+
+  // Adds the measurements and move statistics of an independent chain.
+  void merge(const Solver &other) {
+    for (int a = 0; a < e.flavors(); a++) {
+      g[a] += other.g[a];
+      gl[a] += other.gl[a];
+      giw[a] += other.giw[a];
+      g_binning[a] += other.g_binning[a];
+      f[a] += other.f[a];
+      fiw[a] += other.fiw[a];
+    }
+    occupation += other.occupation;
+    double_occupancy += other.double_occupancy;
+    move_prop += other.move_prop;
+    move_acc += other.move_acc;
+    sampled_epochs += other.sampled_epochs;
+  }
+
+  // Clears the measurements and move statistics. The chain state and the
+  // generator are kept, so the next solve continues the same chain.
+  void reset() {
+    for (int a = 0; a < e.flavors(); a++) {
+      g[a] = GreensFunction(e.beta, nt);
+      gl[a] = LegendreGreensFunction(e.beta, gl[a].N);
+      giw[a] = MatsubaraGreensFunction(e.beta, giw[a].N);
+      g_binning[a] = Binning(nt);
+      f[a] = GreensFunction(e.beta, nt);
+      fiw[a] = MatsubaraGreensFunction(e.beta, fiw[a].N);
+    }
+    occupation = 0.0;
+    double_occupancy = 0.0;
+    move_prop = 0.0;
+    move_acc = 0.0;
+    sampled_epochs = 0;
+  }
+
+  Expansion &expansion() { return e; }
+
+  bool shared_hybridization(int a, int b) const {
+    return &e.Delta[a].get() == &e.Delta[b].get();
+  }
+
+  // Determinant of flavor a's configuration c, in the ordering of
+  // FastUpdate::value.
+  LogValue determinant(Configuration &c, int a) { return d[a].determinant(c); }
+
+  // Sign of the weight of c, whose determinants are the current blocks.
+  double weight_sign(Configurations &c) {
+    auto w = log_trace(c, e);
+    for (auto &block : d) {
+      w *= block.value();
+    }
+    return w.sign;
+  }
+
+  void sample_greens_function(Configurations &c) {
+    auto s = weight_sign(c);
+    empty_flavor_occupation(c, e, P);
+    sample_occupations(c, P, s);
+    for (int a = 0; a < e.flavors(); a++) {
+      auto &da = d[a];
+      da.flush();
+      g[a].sign += s;
+      gl[a].sign += s;
+      giw[a].sign += s;
+      g_sample.data = 0.0;
+      g_sample.accumulate(da.t_i.data(), da.t_f.data(), da.k, da.M.data(),
+                          da.M.stride());
+      for (auto i = 0; i < da.k; i++) {
+        gl[a].accumulate(da.t_f.data(), da.k, da.t_i(i), &da.M(i, 0));
+        giw[a].accumulate(da.t_f.data(), da.k, da.t_i(i), &da.M(i, 0));
+      }
+      g[a].data += g_sample.data;
+      g_binning[a].add(g_sample.data.data(), s);
+      sample_improved_estimator(c, P, a, s);
+    }
+  }
+
+  // F(tau) of flavor a: the G(tau) estimator with row i of M weighted by
+  // sum_b U_ab n_b(t_i(i)), the interaction felt at the creator. Empty
+  // flavors count with their probability to be occupied.
+  void sample_improved_estimator(Configurations &c, nda::matrix<double> &P,
+                                 int a, double s) {
+    auto &da = d[a];
+    f[a].sign += s;
+    fiw[a].sign += s;
+    bool interacting = false;
+    for (int b = 0; b < e.flavors(); b++) {
+      interacting = interacting || (b != a && e.U(a, b) != 0.0);
+    }
+    if (!interacting || da.k == 0) {
+      return;
+    }
+    if (row_weight.size() < da.k) {
+      // Doubled, so that a rising expansion order reallocates rarely.
+      row_weight = nda::zeros<double>(2 * da.k);
+      row = nda::zeros<double>(2 * da.k);
+    }
+    for (int i = 0; i < da.k; i++) {
+      double w = 0.0;
+      for (int b = 0; b < e.flavors(); b++) {
+        if (b == a || e.U(a, b) == 0.0) {
+          continue;
+        }
+        w += e.U(a, b) * (c[b].length() > 0 ? c[b].occupied(da.t_i(i))
+                                            : P(b, b));
+      }
+      row_weight(i) = w;
+    }
+    f[a].accumulate(da.t_i.data(), da.t_f.data(), da.k, da.M.data(),
+                    da.M.stride(), row_weight.data());
+    if (fiw[a].N == 0) {
+      return;
+    }
+    for (int i = 0; i < da.k; i++) {
+      for (int j = 0; j < da.k; j++) {
+        row(j) = row_weight(i) * da.M(i, j);
+      }
+      fiw[a].accumulate(da.t_f.data(), da.k, da.t_i(i), row.data());
+    }
+  }
 
-  Solver(Hybridization &Delta, Expansion &e, std::vector<MoveFunc> moves,
-         int nt)
-      : Delta(Delta), e(e), moves(moves), nt(nt), g(e.beta, nt) {
-    move_prop = nda::zeros<double>(moves.size());
-    move_acc = nda::zeros<double>(moves.size());
+  // n_a = L_a / beta and n_a n_b = O_ab / beta from the segment lengths and
+  // overlaps; flavors without operators enter through P.
+  void sample_occupations(Configurations &c, nda::matrix<double> &P, double s) {
+    int n = e.flavors();
+    for (int a = 0; a < n; a++) {
+      double n_a = c[a].length() > 0 ? c[a].occupation(e.beta) / e.beta
+                                     : P(a, a);
+      occupation(a) += s * n_a;
+      double_occupancy(a, a) += s * n_a;
+      for (int b = a + 1; b < n; b++) {
+        double n_ab;
+        if (c[a].length() > 0 && c[b].length() > 0) {
+          double overlap = 0.0;
+          for (auto seg : segments(c[a])) {
+            overlap += c[b].overlap(seg.t_i, seg.t_f, e.beta);
+          }
+          n_ab = overlap / e.beta;
+        } else if (c[a].length() > 0) {
+          n_ab = P(b, b) * c[a].occupation(e.beta) / e.beta;
+        } else if (c[b].length() > 0) {
+          n_ab = P(a, a) * c[b].occupation(e.beta) / e.beta;
+        } else {
+          n_ab = P(a, b);
+        }
+        double_occupancy(a, b) += s * n_ab;
+        double_occupancy(b, a) += s * n_ab;
+      }
+    }
   }
 
-  void sample_greens_function(Configuration &c) {
-    auto d = Determinant(c, e);
-    auto M = inverse(d.mat);
-    auto w = trace(c, e) * d.value;
-    g.sign += sign(w);
-    for (auto i = 0; i < c.length(); i++) {
-      for (auto j = 0; j < c.length(); j++) {
-        g.accumulate(d.t_f(i) - d.t_i(j), M(j, i));
+  // <n_a> per line, then the rows of <n_a n_b>.
+  int write_occupations(std::string filename) const {
+    std::ofstream out(filename);
+    if (!out.is_open()) {
+      std::cerr << "Failed to open file!" << std::endl;
+      return 1;
+    }
+    double sign = g[0].sign;
+    for (int a = 0; a < e.flavors(); a++) {
+      out << occupation(a) / sign << std::endl;
+    }
+    for (int a = 0; a < e.flavors(); a++) {
+      for (int b = 0; b < e.flavors(); b++) {
+        out << double_occupancy(a, b) / sign << " ";
       }
+      out << std::endl;
+    }
+    return 0;
+  }
+
+  // Error bars of G(tau) of flavor a, normalized like
+  // GreensFunction::write_data.
+  nda::vector<double> g_error(int a) const {
+    double dt = e.beta / nt;
+    return g_binning[a].error() / (e.beta * dt);
+  }
+
+  void report_errors() const {
+    for (int a = 0; a < e.flavors(); a++) {
+      auto err = g_error(a);
+      auto tau = g_binning[a].autocorrelation_time();
+      std::cout << "Flavor " << a << ": sign " << g_binning[a].sign() << " +- "
+                << g_binning[a].sign_error() << ", max G(tau) error "
+                << *std::max_element(err.begin(), err.end())
+                << ", max autocorrelation time "
+                << *std::max_element(tau.begin(), tau.end())
+                << " epochs (binning level " << g_binning[a].level() << ")"
+                << std::endl;
     }
   }
 
-  double propose(Configuration &c, InsertMove &move) {
-    auto cnew = c + move;
-    double R = move.l * e.beta / cnew.length() *
-               (std::abs(eval(cnew, e) / eval(c, e)));
+  double propose(Configurations &c, InsertMove &move) {
+    if (move.l == 0) {
+      return 0.0;
+    }
+    auto &ca = c[move.flavor];
+    double L = ca.occupation(e.beta);
+    double log_weight = log_empty_flavor_weight(c, e);
+    ca.insert(move);
+    double dL = ca.occupation(e.beta) - L;
+    double t = dL > 0.0 ? trace_ratio(c, e, move.flavor, dL, move.t_i,
+                                      move.t_f, log_weight)
+                        : trace_ratio(c, e, move.flavor, dL, move.t_f,
+                                      move.t_i, log_weight);
+    double R = move.l * e.beta / ca.length() *
+               std::abs(t * d[move.flavor].ratio(move));
     return R;
   }
 
-  double propose(Configuration &c, RemovalMove &move) {
-    auto cnew = c + move;
+  double propose(Configurations &c, RemovalMove &move) {
     if (move.l == 0) {
       return std::numeric_limits<double>::quiet_NaN();
     }
-    double R =
-        c.length() / e.beta / move.l * (std::abs(eval(cnew, e) / eval(c, e)));
+    auto &ca = c[move.flavor];
+    double t_i = ca.t_i(move.i_idx);
+    double t_f = ca.t_f(move.f_idx);
+    double L = ca.occupation(e.beta);
+    double log_weight = log_empty_flavor_weight(c, e);
+    double r = d[move.flavor].ratio(move);
+    double R = ca.length() / e.beta / move.l;
+    ca.remove(move);
+    double dL = ca.occupation(e.beta) - L;
+    double t = dL < 0.0
+                   ? trace_ratio(c, e, move.flavor, dL, t_i, t_f, log_weight)
+                   : trace_ratio(c, e, move.flavor, dL, t_f, t_i, log_weight);
+    R *= std::abs(t * r);
     return R;
   }
 
-  Configuration finalize(Configuration &c, InsertMove &move) {
-    auto cnew = c + move;
-    return cnew;
+  double propose(Configurations &c, ShiftMove &move) {
+    if (move.l == 0) {
+      return 0.0;
+    }
+    auto &ca = c[move.flavor];
+    double t_old = (move.creator ? ca.t_i : ca.t_f)(move.idx);
+    double L = ca.occupation(e.beta);
+    double log_weight = log_empty_flavor_weight(c, e);
+    double r = d[move.flavor].ratio(move);
+    ca.shift(move);
+    double dL = ca.occupation(e.beta) - L;
+    // The interval whose occupation flipped runs from the old time to the new
+    // one when the operator moved forward, which fills it for a t_f and
+    // empties it for a t_i.
+    double t =
+        (move.creator == (dL < 0.0))
+            ? trace_ratio(c, e, move.flavor, dL, t_old, move.t, log_weight)
+            : trace_ratio(c, e, move.flavor, dL, move.t, t_old, log_weight);
+    return std::abs(t * r);
+  }
+
+  // O(k^3) for the new determinant and O(N^2 k) for the trace.
+  double propose(Configurations &c, FlipMove &move) {
+    if (c[move.flavor].length() == 0) {
+      return 0.0;
+    }
+    auto t = log_trace(c, e);
+    double r = d[move.flavor].ratio(move);
+    c[move.flavor].flip();
+    return std::abs((log_trace(c, e) / t).value() * r);
+  }
+
+  // Flavors sharing a hybridization keep their determinants, so only the
+  // trace changes; otherwise both determinants are evaluated from scratch.
+  double propose(Configurations &c, SwapMove &move) {
+    if (move.a == move.b) {
+      return 0.0;
+    }
+    auto t = log_trace(c, e);
+    LogValue r;
+    if (!shared_hybridization(move.a, move.b)) {
+      r = determinant(c[move.a], move.b) * determinant(c[move.b], move.a) /
+          (d[move.a].value() * d[move.b].value());
+    }
+    std::swap(c[move.a], c[move.b]);
+    return std::abs((log_trace(c, e) / t * r).value());
   }
 
-  Configuration finalize(Configuration &c, RemovalMove &move) {
-    auto cnew = c + move;
-    return cnew;
+  void finalize(Configurations &c, InsertMove &move) {
+    c[move.flavor].commit();
+    d[move.flavor].accept(move);
   }
 
-  Configuration metropolis_hastings_update(Configuration &c) {
-    auto move_idx = randomint(0, moves.size() - 1);
-    auto m = moves[move_idx](c, e);
-    double R = 0.0;
-    if (std::holds_alternative<InsertMove>(m)) {
-      InsertMove move = std::get<InsertMove>(m);
+  void finalize(Configurations &c, RemovalMove &move) {
+    c[move.flavor].commit();
+    d[move.flavor].accept(move);
+  }
+
+  void finalize(Configurations &c, ShiftMove &move) {
+    c[move.flavor].commit();
+    d[move.flavor].accept(move);
+  }
+
+  void finalize(Configurations &c, FlipMove &move) {
+    d[move.flavor].accept(move);
+  }
+
+  void finalize(Configurations &c, SwapMove &move) {
+    if (shared_hybridization(move.a, move.b)) {
+      d[move.a].swap(d[move.b]);
+    } else {
+      d[move.a].rebuild(c[move.a]);
+      d[move.b].rebuild(c[move.b]);
+    }
+  }
+
+  template <typename Move> void reject(Configurations &c, Move &move) {
+    c[move.flavor].rollback();
+  }
+
+  void reject(Configurations &c, FlipMove &move) { c[move.flavor].flip(); }
+
+  void reject(Configurations &c, SwapMove &move) {
+    std::swap(c[move.a], c[move.b]);
+  }
+
+  void metropolis_hastings_update(Configurations &c) {
+    auto start = profile.now();
+    int move_idx = moves.select(rng);
+    moves.visit(move_idx, [&](auto generator) {
+      auto move = decltype(generator)::value(c, e, rng);
       move_prop(move_idx) += 1;
-      R = propose(c, move);
-      if (R > nda::rand<>()) {
-        c = finalize(c, move);
+      double R = propose(c, move);
+      if (R > rng.uniform()) {
+        finalize(c, move);
         move_acc(move_idx) += 1;
+      } else {
+        reject(c, move);
       }
-    } else if (std::holds_alternative<RemovalMove>(m)) {
-      RemovalMove move = std::get<RemovalMove>(m);
-      move_prop(move_idx) += 1;
-      R = propose(c, move);
-      if (R > nda::rand<>()) {
-        c = finalize(c, move);
-        move_acc(move_idx) += 1;
+    });
+    profile.update(move_idx, start);
+  }
+
+  // Makes c the state of the chain.
+  void start(Configurations c) {
+    profile.begin();
+    configuration = c;
+    for (int a = 0; a < e.flavors(); a++) {
+      d[a].rebuild(configuration[a]);
+    }
+  }
+
+  void warmup(int epoch_steps, int epochs) {
+    for (auto epoch = 0; epoch < epochs; epoch++) {
+      for (auto step = 0; step < epoch_steps; step++) {
+        metropolis_hastings_update(configuration);
       }
     }
-    return c;
   }
 
-  void solve(Configuration c, int epoch_steps = 10, int warmup_epochs = 1000,
+  void sample(int epoch_steps, long epochs) {
+    for (auto epoch = 0; epoch < epochs; epoch++) {
+      for (auto step = 0; step < epoch_steps; step++) {
+        metropolis_hastings_update(configuration);
+      }
+      auto start = profile.now();
+      sample_greens_function(configuration);
+      profile.measurement(start, expansion_order(configuration));
+      sampled_epochs++;
+      if (checkpoint_period > 0 && sampled_epochs % checkpoint_period == 0) {
+        save_checkpoint(checkpoint_file);
+      }
+    }
+  }
+
+  // Runs the chain from c; the chain ends up in configuration, so passing that
+  // back in with no warmup continues it.
+  void solve(Configurations c, int epoch_steps = 10, int warmup_epochs = 1000,
              long sampling_epochs = 100000) {
 
-    std::cout << "Starting CT-HYB QMC" << std::endl;
+    if (verbose) {
+      std::cout << "Starting CT-HYB QMC" << std::endl;
+      std::cout << "Warmup epochs " << warmup_epochs << " with " << epoch_steps
+                << " steps." << std::endl;
+    }
+    start(c);
+    warmup(epoch_steps, warmup_epochs);
+    if (checkpoint_period > 0 && warmup_epochs > 0) {
+      save_checkpoint(checkpoint_file);
+    }
 
-    std::cout << "Warmup epochs " << warmup_epochs << " with " << epoch_steps
-              << " steps." << std::endl;
+    if (verbose) {
+      std::cout << "Sampling epochs " << sampling_epochs << " with "
+                << epoch_steps << " steps." << std::endl;
+    }
+    sample(epoch_steps, sampling_epochs);
 
-    for (auto epoch = 0; epoch < warmup_epochs; epoch++) {
-      for (auto step = 0; step < epoch_steps; step++) {
-        c = metropolis_hastings_update(c);
+    if (verbose) {
+      report_errors();
+      profile.report(move_prop, move_acc);
+    }
+  }
+
+  // Runs the chain from c until conv is met. Warmup ends once the window
+  // averages of the expansion order and the sign stop changing, sampling once
+  // the largest G(tau) error is below conv.tolerance. Both are cut short by
+  // their epoch limits and by the wall-clock budget. Returns whether the
+  // tolerance was reached.
+  bool solve(Configurations c, const Convergence &conv) {
+    auto begin = std::chrono::steady_clock::now();
+    auto elapsed = [&]() {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                           begin)
+          .count();
+    };
+
+    if (verbose) {
+      std::cout << "Starting CT-HYB QMC" << std::endl;
+    }
+    start(c);
+
+    int warmup_epochs = 0;
+    double last_order = -1.0;
+    double last_sign = 0.0;
+    while (warmup_epochs < conv.max_warmup_epochs &&
+           elapsed() < conv.max_seconds) {
+      double order_sum = 0.0;
+      double sign_sum = 0.0;
+      for (int epoch = 0; epoch < conv.warmup_window; epoch++) {
+        warmup(conv.epoch_steps, 1);
+        order_sum += expansion_order(configuration);
+        sign_sum += weight_sign(configuration);
       }
+      warmup_epochs += conv.warmup_window;
+      double mean_order = order_sum / conv.warmup_window;
+      double mean_sign = sign_sum / conv.warmup_window;
+      bool stable =
+          last_order >= 0.0 &&
+          std::abs(mean_order - last_order) <=
+              conv.warmup_tolerance * std::max(1.0, mean_order) &&
+          std::abs(mean_sign - last_sign) <= conv.warmup_tolerance;
+      if (stable && warmup_epochs >= conv.min_warmup_epochs) {
+        break;
+      }
+      last_order = mean_order;
+      last_sign = mean_sign;
+    }
+    if (checkpoint_period > 0 && warmup_epochs > 0) {
+      save_checkpoint(checkpoint_file);
     }
 
-    std::cout << "Sampling epochs " << sampling_epochs << " with "
-              << epoch_steps << " steps." << std::endl;
+    if (verbose) {
+      std::cout << "Warmup epochs " << warmup_epochs << " with "
+                << conv.epoch_steps << " steps." << std::endl;
+    }
 
-    for (auto epoch = 0; epoch < sampling_epochs; epoch++) {
-      for (auto step = 0; step < epoch_steps; step++) {
-        c = metropolis_hastings_update(c);
+    long sampling_epochs = 0;
+    bool converged = false;
+    while (sampling_epochs < conv.max_sampling_epochs &&
+           elapsed() < conv.max_seconds) {
+      long epochs = std::min(conv.check_period,
+                             conv.max_sampling_epochs - sampling_epochs);
+      sample(conv.epoch_steps, epochs);
+      sampling_epochs += epochs;
+      if (sampling_epochs >= conv.min_sampling_epochs &&
+          max_error() <= conv.tolerance) {
+        converged = true;
+        break;
       }
-      sample_greens_function(c);
     }
+
+    if (verbose) {
+      std::cout << "Sampling epochs " << sampling_epochs << " with "
+                << conv.epoch_steps << " steps, "
+                << (converged ? "converged" : "not converged") << " after "
+                << elapsed() << " s." << std::endl;
+      report_errors();
+      profile.report(move_prop, move_acc);
+    }
+    return converged;
+  }
+
+  // Largest G(tau) error over all flavors, infinite while some flavor has too
+  // few blocks for an estimate.
+  double max_error() const {
+    double max = 0.0;
+    for (int a = 0; a < e.flavors(); a++) {
+      if (g_binning[a].level() < 0) {
+        return std::numeric_limits<double>::infinity();
+      }
+      auto err = g_error(a);
+      max = std::max(max, *std::max_element(err.begin(), err.end()));
+    }
+    return max;
+  }
+
+  // Starts every flavor from c.
+  void solve(Configuration c, int epoch_steps = 10, int warmup_epochs = 1000,
+             long sampling_epochs = 100000) {
+    solve(Configurations(e.flavors(), c), epoch_steps, warmup_epochs,
+          sampling_epochs);
+  }
+
+  // Writes the configuration, generator state, accumulators and move
+  // statistics to a temporary file that then replaces filename, so an
+  // interrupted write never leaves a truncated checkpoint behind.
+  int save_checkpoint(std::string filename) const {
+    std::string tmp = filename + ".tmp";
+    std::ofstream out(tmp, std::ios::binary);
+    if (!out.is_open()) {
+      std::cerr << "Failed to open file!" << std::endl;
+      return 1;
+    }
+    write_configurations(out, configuration, e.beta);
+    for (auto s : rng.state) {
+      write_value(out, s);
+    }
+    write_value(out, sampled_epochs);
+    for (int a = 0; a < e.flavors(); a++) {
+      write_vector(out, g[a].data);
+      write_value(out, g[a].sign);
+      write_vector(out, gl[a].data);
+      write_value(out, gl[a].sign);
+      write_vector(out, giw[a].data);
+      write_value(out, giw[a].sign);
+      write_binning(out, g_binning[a]);
+      write_vector(out, f[a].data);
+      write_value(out, f[a].sign);
+      write_vector(out, fiw[a].data);
+      write_value(out, fiw[a].sign);
+    }
+    write_vector(out, occupation);
+    write_matrix(out, double_occupancy);
+    write_vector(out, move_prop);
+    write_vector(out, move_acc);
+    out.close();
+    if (!out || std::rename(tmp.c_str(), filename.c_str()) != 0) {
+      std::cerr << "Failed to write checkpoint!" << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  // Restores a checkpoint written by a Solver with the same expansion, moves
+  // and accumulator sizes. The chain continues exactly with
+  // solve(configuration, epoch_steps, 0, ...).
+  int load_checkpoint(std::string filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open()) {
+      std::cerr << "Failed to open file!" << std::endl;
+      return 1;
+    }
+    Configurations c;
+    double beta;
+    Rng r;
+    long epochs;
+    bool ok = read_configurations(in, c, beta) && beta == e.beta &&
+              static_cast<int>(c.size()) == e.flavors();
+    for (auto &s : r.state) {
+      ok = ok && read_value(in, s);
+    }
+    ok = ok && read_value(in, epochs);
+    auto g_ = g;
+    auto gl_ = gl;
+    auto giw_ = giw;
+    auto g_binning_ = g_binning;
+    auto f_ = f;
+    auto fiw_ = fiw;
+    auto occupation_ = occupation;
+    auto double_occupancy_ = double_occupancy;
+    for (int a = 0; a < e.flavors() && ok; a++) {
+      ok = read_vector(in, g_[a].data, g[a].N) && read_value(in, g_[a].sign) &&
+           read_vector(in, gl_[a].data, gl[a].N) &&
+           read_value(in, gl_[a].sign) &&
+           read_vector(in, giw_[a].data, giw[a].N) &&
+           read_value(in, giw_[a].sign) && read_binning(in, g_binning_[a]) &&
+           read_vector(in, f_[a].data, f[a].N) && read_value(in, f_[a].sign) &&
+           read_vector(in, fiw_[a].data, fiw[a].N) &&
+           read_value(in, fiw_[a].sign);
+    }
+    nda::vector<double> prop, acc;
+    ok = ok && read_vector(in, occupation_, e.flavors()) &&
+         read_matrix(in, double_occupancy_) &&
+         read_vector(in, prop, Moves::size) &&
+         read_vector(in, acc, Moves::size);
+    if (!ok) {
+      std::cerr << "Invalid checkpoint file!" << std::endl;
+      return 1;
+    }
+    configuration = c;
+    rng = r;
+    sampled_epochs = epochs;
+    g = g_;
+    gl = gl_;
+    giw = giw_;
+    g_binning = g_binning_;
+    f = f_;
+    fiw = fiw_;
+    occupation = occupation_;
+    double_occupancy = double_occupancy_;
+    move_prop = prop;
+    move_acc = acc;
+    return 0;
   }
 };
 
+// Solver(e, nt, ...) uses DefaultMoves instead of deducing Moves from nt
+// through the primary constructor. The seed type is deduced so that this guide
+// matches any integer seed as well as that constructor, and wins the tie.
+template <typename Seed = std::uint64_t>
+Solver(Expansion &, int, int = 0, int = 0, Seed = 0) -> Solver<DefaultMoves>;
+
 } // namespace tinycthyb
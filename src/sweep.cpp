@@ -0,0 +1,51 @@
+#include "green.hpp"
+#include "solver.hpp"
+#include "sweep.hpp"
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+
+using namespace tinycthyb;
+
+// Reads "beta h" pairs, one point per line, from the file given as the first
+// argument, solves all points in one process and writes gmeasure_<i>.txt and
+// occupation_<i>.txt for point i.
+int main(int argc, char *argv[]) {
+
+  if (argc < 2) {
+    std::cerr << "Usage: sweep points.txt" << std::endl;
+    return 1;
+  }
+  std::ifstream inputFile(argv[1]);
+  if (!inputFile.is_open()) {
+    std::cerr << "Failed to open file!" << std::endl;
+    return 1;
+  }
+  std::vector<SweepPoint> points;
+  double beta, h;
+  while (inputFile >> beta >> h) {
+    points.push_back({beta, h});
+  }
+
+  int nt = 200;
+  auto moves = MoveSet<NewSegmentInsertionMove, NewAntiSegmentInsertionMove,
+                       NewSegmentRemoveMove, NewAntiSegmentRemoveMove,
+                       NewShiftMove>();
+  auto sweep = Sweep(
+      points, [&](double beta) { return semi_circular_hybridization(beta, nt); },
+      moves, nt);
+
+  Convergence conv;
+  conv.tolerance = 0.01;
+  int n_threads = std::max(1u, std::thread::hardware_concurrency());
+  sweep.run(n_threads, std::random_device{}(), conv);
+
+  int n = points.size();
+  for (int i = 0; i < n; i++) {
+    sweep.solvers[i].g[0].write_data("gmeasure_" + std::to_string(i) + ".txt");
+    sweep.solvers[i].write_occupations("occupation_" + std::to_string(i) +
+                                       ".txt");
+  }
+  return 0;
+}
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "configuration.hpp"
+#include "hybridization.hpp"
+#include "rng.hpp"
+#include "solver.hpp"
+
+namespace tinycthyb {
+
+struct SweepPoint {
+  double beta;
+  double h;
+};
+
+// Task indices in one deque per thread. A thread takes its own tasks from the
+// front, in the order they were pushed, and once it runs dry steals from the
+// back of the others, the tasks their owners would reach last.
+class WorkQueues {
+public:
+  WorkQueues(int n) : queues(n), locks(n) {}
+
+  void push(int q, int task) {
+    std::lock_guard<std::mutex> lock(locks[q]);
+    queues[q].push_back(task);
+  }
+
+  std::optional<int> pop(int q) {
+    {
+      std::lock_guard<std::mutex> lock(locks[q]);
+      if (!queues[q].empty()) {
+        int task = queues[q].front();
+        queues[q].pop_front();
+        return task;
+      }
+    }
+    int n = queues.size();
+    for (int offset = 1; offset < n; offset++) {
+      int victim = (q + offset) % n;
+      std::lock_guard<std::mutex> lock(locks[victim]);
+      if (!queues[victim].empty()) {
+        int task = queues[victim].back();
+        queues[victim].pop_back();
+        return task;
+      }
+    }
+    return std::nullopt;
+  }
+
+private:
+  std::vector<std::deque<int>> queues;
+  std::vector<std::mutex> locks;
+};
+
+// Solves one single-flavor expansion per (beta, h) point on a pool of
+// threads. Points with the same beta share one Hybridization table, built
+// once by make_hybridization and only read by the solvers. The points are
+// dealt out in order of beta and h, in one contiguous run per thread, so a
+// thread mostly moves between neighbouring points; each point starts from the
+// final configuration of the nearest point already solved, with its times
+// rescaled to the new beta, and needs at most warm_warmup_epochs of warmup.
+// Only the first points, solved before any neighbour, start empty.
+template <typename Moves = DefaultMoves> class Sweep {
+public:
+  std::vector<SweepPoint> points;
+  std::vector<Hybridization> tables;
+  std::vector<Expansion> expansions;
+  std::vector<Solver<Moves>> solvers;
+  // Index of the point each point was started from, -1 for an empty start.
+  std::vector<int> seeded_from;
+  int warm_warmup_epochs = 200;
+  bool verbose = true;
+
+  Sweep(std::vector<SweepPoint> points,
+        std::function<Hybridization(double)> make_hybridization, Moves moves,
+        int nt, int n_legendre = 0, int n_matsubara = 0)
+      : points(points), seeded_from(points.size(), -1),
+        thermalized(points.size(), false) {
+    std::vector<double> betas;
+    for (auto &p : points) {
+      if (std::find(betas.begin(), betas.end(), p.beta) == betas.end()) {
+        betas.push_back(p.beta);
+        tables.push_back(make_hybridization(p.beta));
+      }
+    }
+    // The expansions and solvers hold references into tables and
+    // expansions, which must not reallocate from here on.
+    expansions.reserve(points.size());
+    solvers.reserve(points.size());
+    for (auto &p : points) {
+      int table =
+          std::find(betas.begin(), betas.end(), p.beta) - betas.begin();
+      expansions.emplace_back(p.beta, p.h, tables[table]);
+      solvers.emplace_back(expansions.back(), moves, nt, n_legendre,
+                           n_matsubara);
+    }
+  }
+
+  Sweep(const Sweep &) = delete;
+  Sweep &operator=(const Sweep &) = delete;
+
+  // Point i uses stream i of the generator seeded with seed, whichever thread
+  // runs it.
+  void run(int n_threads, std::uint64_t seed, const Convergence &conv) {
+    int n = points.size();
+    std::vector<int> order(n);
+    for (int i = 0; i < n; i++) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+      return std::make_pair(points[a].beta, points[a].h) <
+             std::make_pair(points[b].beta, points[b].h);
+    });
+    WorkQueues queues(n_threads);
+    for (int i = 0; i < n; i++) {
+      queues.push(i * n_threads / n, order[i]);
+    }
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; t++) {
+      threads.emplace_back([&, t]() {
+        while (auto i = queues.pop(t)) {
+          solve_point(*i, seed, conv);
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+
+private:
+  std::vector<bool> thermalized;
+  std::mutex lock;
+
+  // Distance in the (beta, h) plane.
+  int nearest_thermalized(int i) {
+    int best = -1;
+    double best_distance = std::numeric_limits<double>::infinity();
+    int n = points.size();
+    for (int j = 0; j < n; j++) {
+      if (!thermalized[j]) {
+        continue;
+      }
+      double distance = std::hypot(points[j].beta - points[i].beta,
+                                   points[j].h - points[i].h);
+      if (distance < best_distance) {
+        best = j;
+        best_distance = distance;
+      }
+    }
+    return best;
+  }
+
+  void solve_point(int i, std::uint64_t seed, const Convergence &conv) {
+    auto &S = solvers[i];
+    S.verbose = false;
+    S.rng = Rng(seed, i);
+    auto point_conv = conv;
+    Configurations c{Configuration(nda::vector<double>{},
+                                   nda::vector<double>{})};
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      seeded_from[i] = nearest_thermalized(i);
+    }
+    if (seeded_from[i] >= 0) {
+      int j = seeded_from[i];
+      c = rescale(solvers[j].configuration, points[i].beta / points[j].beta);
+      point_conv.min_warmup_epochs = 0;
+      point_conv.max_warmup_epochs = warm_warmup_epochs;
+    }
+    bool converged = S.solve(c, point_conv);
+
+    std::lock_guard<std::mutex> guard(lock);
+    thermalized[i] = true;
+    if (verbose) {
+      std::cout << "Point " << i << " (beta " << points[i].beta << ", h "
+                << points[i].h << ") "
+                << (converged ? "converged" : "not converged")
+                << " with max G(tau) error " << S.max_error();
+      if (seeded_from[i] >= 0) {
+        std::cout << ", started from point " << seeded_from[i];
+      }
+      std::cout << std::endl;
+    }
+  }
+};
+
+} // namespace tinycthyb
@@ -1,60 +1,76 @@
 #pragma once
 
 #include "nda/nda.hpp"
+#include <algorithm>
 #include <cmath>
+#include <limits>
+#include <utility>
 
-template <typename T> nda::vector<T> deleteat(const nda::vector<T> old, int idx) {
-  nda::vector<T> out = nda::zeros<T>(old.extent(0) - 1);
-  int k = 0;
-  for (int i = 0; i < old.size(); i++) {
-    if (i != idx) {
-      out(k) = old(i);
-      k++;
-    }
-  }
-  return out;
+template <typename T> int sign(T number) {
+  return std::signbit(number) ? -1 : (number > 0 ? 1 : 0);
 }
 
-template <typename T> nda::vector<T> roll(const nda::vector<T> &a, int shift) {
-  auto N = a.size();
-  auto A = nda::zeros<T>(N);
-  for (int i = 0; i < N; i++) {
-    auto idx = i < N ? (N + i - shift) % N : i;
-    A(idx) = a(i);
+// A real number kept as log|x| and its sign, so that long products of large or
+// small factors, like determinants and traces at large beta and order,
+// neither overflow nor underflow. Zero has log -inf and sign 0.
+struct LogValue {
+  double log = 0.0;
+  int sign = 1;
+
+  LogValue() = default;
+  LogValue(double log, int sign) : log(log), sign(sign) {}
+
+  static LogValue of(double x) {
+    return LogValue(std::log(std::abs(x)), x < 0.0 ? -1 : (x > 0.0 ? 1 : 0));
   }
-  return A;
-}
 
-template <typename T> nda::vector<T> hstack(const nda::vector<T> &a, T &b) {
-  auto N = a.size();
-  auto A = nda::zeros<T>(N + 1);
-  for (auto i = 0; i < N; i++) {
-    A(i) = a(i);
+  double value() const { return sign * std::exp(log); }
+
+  LogValue &operator*=(const LogValue &other) {
+    log += other.log;
+    sign *= other.sign;
+    return *this;
   }
-  A(N) = b;
-  return A;
-}
 
-template <typename T>
-nda::vector<T> stack(const nda::vector<T> &a, nda::vector<T> &b) {
-  auto N = a.size();
-  auto M = b.size();
-  auto A = nda::zeros<T>(N + M);
-  for (auto i = 0; i < N; i++) {
-    A(i) = a(i);
+  LogValue &operator*=(double x) { return *this *= of(x); }
+
+  LogValue operator*(const LogValue &other) const {
+    return LogValue(log + other.log, sign * other.sign);
   }
-  for (auto j = N + 1; j < M + N; j++) {
-    A(j) = b(j);
+
+  LogValue operator/(const LogValue &other) const {
+    return LogValue(log - other.log, sign * other.sign);
   }
-  return A;
-}
+};
 
-int randomint(int min, int max) {
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_int_distribution<int> dis(min, max);
-  return dis(gen);
-}
-template <typename T> int sign(T number) {
-  return std::signbit(number) ? -1 : (number > 0 ? 1 : 0);
+// Determinant by LU decomposition with partial pivoting, accumulated in log
+// space.
+LogValue log_determinant(nda::matrix<double> mat) {
+  int n = mat.shape()[0];
+  LogValue det;
+  for (int j = 0; j < n; j++) {
+    int p = j;
+    for (int i = j + 1; i < n; i++) {
+      if (std::abs(mat(i, j)) > std::abs(mat(p, j))) {
+        p = i;
+      }
+    }
+    if (mat(p, j) == 0.0) {
+      return LogValue(-std::numeric_limits<double>::infinity(), 0);
+    }
+    if (p != j) {
+      for (int l = 0; l < n; l++) {
+        std::swap(mat(p, l), mat(j, l));
+      }
+      det.sign = -det.sign;
+    }
+    det *= mat(j, j);
+    for (int i = j + 1; i < n; i++) {
+      double x = mat(i, j) / mat(j, j);
+      for (int l = j + 1; l < n; l++) {
+        mat(i, l) -= x * mat(j, l);
+      }
+    }
+  }
+  return det;
 }